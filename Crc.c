@@ -0,0 +1,315 @@
+/*
+* CRC-32C and CRC-64/XZ.
+*
+* Portable code uses slicing-by-8 tables. Polynomial arithmetic follows the
+* reflected representation of zlib: bit 0 of a value is the coefficient of
+* the highest power, so that x^0 is the top bit.
+*
+* The SSE4.2 code computes three streams of equal length at the same time to
+* hide the latency of the crc32 instruction, and merges them with a table
+* multiplying a CRC by x^(8 * stride). The strides decrease so that the 4 KB
+* blocks hashed by DirHash also run three streams for all but 256 bytes. The PCLMULQDQ code folds
+* four 128-bit accumulators over 64-byte blocks; the last 16 bytes of
+* remainder are reduced with the tables.
+*/
+
+#include "Crc.h"
+#include "cpu.h"
+
+#define CRC32C_POLY		0x82F63B78
+#define CRC64_POLY		0xC96C5795D7870F42ULL
+
+#define CRC32C_STRIDES	3
+
+#if (CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X64) && CRYPTOPP_BOOL_SSE41_INTRINSICS_AVAILABLE && (defined(_MSC_VER) || defined(__SSE4_2__))
+#include <nmmintrin.h>
+#define CRC_SSE42_AVAILABLE
+#endif
+
+#if (CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X64) && CRYPTOPP_BOOL_AESNI_INTRINSICS_AVAILABLE && (defined(_MSC_VER) || defined(__PCLMUL__))
+#define CRC_CLMUL_AVAILABLE
+#endif
+
+static uint32 g_crc32cTable[8][256];
+static uint64 g_crc64Table[8][256];
+
+/* x^(2^k) modulo the polynomials, for the stride shift and folding constants */
+static uint32 g_crc32cX2n[32];
+static uint64 g_crc64X2n[64];
+
+#ifdef CRC_SSE42_AVAILABLE
+static const size_t g_crc32cStrides[CRC32C_STRIDES] = { 4096, 1024, 256 };
+/* multiplication by x^(8 * stride) for each stride, one table per byte of the CRC */
+static uint32 g_crc32cShiftTable[CRC32C_STRIDES][4][256];
+#endif
+
+#ifdef CRC_CLMUL_AVAILABLE
+/* folding constants: x^(d + 63) and x^(d - 1) modulo P for d = 128 and 512 */
+static uint64 g_crc64Fold128[2];
+static uint64 g_crc64Fold512[2];
+#endif
+
+static uint32 MultModP32(uint32 a, uint32 b)
+{
+	uint32 m = (uint32) 1 << 31, p = 0;
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1)? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+static uint64 MultModP64(uint64 a, uint64 b)
+{
+	uint64 m = (uint64) 1 << 63, p = 0;
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1)? (b >> 1) ^ CRC64_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) modulo P */
+static uint32 X2nModP32(uint64 n, unsigned int k)
+{
+	uint32 p = (uint32) 1 << 31;
+	for (; n; n >>= 1, k++)
+	{
+		if (n & 1)
+			p = MultModP32(g_crc32cX2n[k & 31], p);
+	}
+	return p;
+}
+
+static uint64 X2nModP64(uint64 n, unsigned int k)
+{
+	uint64 p = (uint64) 1 << 63;
+	for (; n; n >>= 1, k++)
+	{
+		if (n & 1)
+			p = MultModP64(g_crc64X2n[k & 63], p);
+	}
+	return p;
+}
+
+void Crc_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+	{
+		uint32 crc32 = (uint32) i;
+		uint64 crc64 = (uint64) i;
+		for (k = 0; k < 8; k++)
+		{
+			crc32 = (crc32 & 1)? (crc32 >> 1) ^ CRC32C_POLY : crc32 >> 1;
+			crc64 = (crc64 & 1)? (crc64 >> 1) ^ CRC64_POLY : crc64 >> 1;
+		}
+		g_crc32cTable[0][i] = crc32;
+		g_crc64Table[0][i] = crc64;
+	}
+	for (k = 1; k < 8; k++)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			g_crc32cTable[k][i] = (g_crc32cTable[k - 1][i] >> 8) ^ g_crc32cTable[0][g_crc32cTable[k - 1][i] & 0xFF];
+			g_crc64Table[k][i] = (g_crc64Table[k - 1][i] >> 8) ^ g_crc64Table[0][g_crc64Table[k - 1][i] & 0xFF];
+		}
+	}
+
+	g_crc32cX2n[0] = (uint32) 1 << 30;	/* x^1 */
+	for (k = 1; k < 32; k++)
+		g_crc32cX2n[k] = MultModP32(g_crc32cX2n[k - 1], g_crc32cX2n[k - 1]);
+	g_crc64X2n[0] = (uint64) 1 << 62;
+	for (k = 1; k < 64; k++)
+		g_crc64X2n[k] = MultModP64(g_crc64X2n[k - 1], g_crc64X2n[k - 1]);
+
+#ifdef CRC_SSE42_AVAILABLE
+	{
+		int s;
+		for (s = 0; s < CRC32C_STRIDES; s++)
+		{
+			uint32 shift = X2nModP32(g_crc32cStrides[s], 3);
+			for (k = 0; k < 4; k++)
+			{
+				for (i = 0; i < 256; i++)
+					g_crc32cShiftTable[s][k][i] = MultModP32(shift, (uint32) i << (8 * k));
+			}
+		}
+	}
+#endif
+
+#ifdef CRC_CLMUL_AVAILABLE
+	g_crc64Fold128[0] = X2nModP64(128 + 63, 0);
+	g_crc64Fold128[1] = X2nModP64(128 - 1, 0);
+	g_crc64Fold512[0] = X2nModP64(512 + 63, 0);
+	g_crc64Fold512[1] = X2nModP64(512 - 1, 0);
+#endif
+}
+
+EXPLICIT_INLINE uint32 Load32(const byte *p)
+{
+	return (uint32) p[0] | ((uint32) p[1] << 8) | ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+EXPLICIT_INLINE uint64 Load64(const byte *p)
+{
+	return (uint64) Load32(p) | ((uint64) Load32(p + 4) << 32);
+}
+
+/* the functions below work on the register, i.e. without the initial and final inversions */
+
+static uint32 Crc32cTable(uint32 crc, const byte *data, size_t len)
+{
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		uint32 low = crc ^ Load32(data), high = Load32(data + 4);
+		crc = g_crc32cTable[7][low & 0xFF] ^ g_crc32cTable[6][(low >> 8) & 0xFF]
+			^ g_crc32cTable[5][(low >> 16) & 0xFF] ^ g_crc32cTable[4][low >> 24]
+			^ g_crc32cTable[3][high & 0xFF] ^ g_crc32cTable[2][(high >> 8) & 0xFF]
+			^ g_crc32cTable[1][(high >> 16) & 0xFF] ^ g_crc32cTable[0][high >> 24];
+	}
+	for (; len; len--)
+		crc = (crc >> 8) ^ g_crc32cTable[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
+
+static uint64 Crc64Table(uint64 crc, const byte *data, size_t len)
+{
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		crc ^= Load64(data);
+		crc = g_crc64Table[7][crc & 0xFF] ^ g_crc64Table[6][(crc >> 8) & 0xFF]
+			^ g_crc64Table[5][(crc >> 16) & 0xFF] ^ g_crc64Table[4][(crc >> 24) & 0xFF]
+			^ g_crc64Table[3][(crc >> 32) & 0xFF] ^ g_crc64Table[2][(crc >> 40) & 0xFF]
+			^ g_crc64Table[1][(crc >> 48) & 0xFF] ^ g_crc64Table[0][crc >> 56];
+	}
+	for (; len; len--)
+		crc = (crc >> 8) ^ g_crc64Table[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
+
+#ifdef CRC_SSE42_AVAILABLE
+
+#if CRYPTOPP_BOOL_X64
+#define CRC32C_WORD(crc, p)	((uint32) _mm_crc32_u64((crc), Load64(p)))
+#else
+#define CRC32C_WORD(crc, p)	_mm_crc32_u32(_mm_crc32_u32((crc), Load32(p)), Load32((p) + 4))
+#endif
+
+EXPLICIT_INLINE uint32 Crc32cShift(const uint32 table[4][256], uint32 crc)
+{
+	return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+
+static uint32 Crc32cSse42(uint32 crc, const byte *data, size_t len)
+{
+	int s;
+	for (s = 0; s < CRC32C_STRIDES; s++)
+	{
+		size_t stride = g_crc32cStrides[s];
+		for (; len >= 3 * stride; data += 3 * stride, len -= 3 * stride)
+		{
+			uint32 crc1 = 0, crc2 = 0;
+			const byte *p;
+			for (p = data; p < data + stride; p += 8)
+			{
+				crc = CRC32C_WORD(crc, p);
+				crc1 = CRC32C_WORD(crc1, p + stride);
+				crc2 = CRC32C_WORD(crc2, p + 2 * stride);
+			}
+			crc = Crc32cShift(g_crc32cShiftTable[s], Crc32cShift(g_crc32cShiftTable[s], crc) ^ crc1) ^ crc2;
+		}
+	}
+	for (; len >= 8; data += 8, len -= 8)
+		crc = CRC32C_WORD(crc, data);
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+
+#endif
+
+#ifdef CRC_CLMUL_AVAILABLE
+
+static __m128i Crc64Fold(__m128i x, __m128i constants)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, constants, 0x00), _mm_clmulepi64_si128(x, constants, 0x11));
+}
+
+static uint64 Crc64Clmul(uint64 crc, const byte *data, size_t len)
+{
+	__m128i x0, x1, x2, x3, fold512, fold128;
+	CRYPTOPP_ALIGN_DATA(16) byte remainder[16];
+
+	if (len < 64)
+		return Crc64Table(crc, data, len);
+
+	fold512 = _mm_set_epi32((int) (g_crc64Fold512[1] >> 32), (int) g_crc64Fold512[1], (int) (g_crc64Fold512[0] >> 32), (int) g_crc64Fold512[0]);
+	fold128 = _mm_set_epi32((int) (g_crc64Fold128[1] >> 32), (int) g_crc64Fold128[1], (int) (g_crc64Fold128[0] >> 32), (int) g_crc64Fold128[0]);
+
+	/* the register is added to the first 64 bits of the message */
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) data), _mm_set_epi32(0, 0, (int) (crc >> 32), (int) crc));
+	x1 = _mm_loadu_si128((const __m128i*) (data + 16));
+	x2 = _mm_loadu_si128((const __m128i*) (data + 32));
+	x3 = _mm_loadu_si128((const __m128i*) (data + 48));
+	data += 64;
+	len -= 64;
+
+	for (; len >= 64; data += 64, len -= 64)
+	{
+		x0 = _mm_xor_si128(Crc64Fold(x0, fold512), _mm_loadu_si128((const __m128i*) data));
+		x1 = _mm_xor_si128(Crc64Fold(x1, fold512), _mm_loadu_si128((const __m128i*) (data + 16)));
+		x2 = _mm_xor_si128(Crc64Fold(x2, fold512), _mm_loadu_si128((const __m128i*) (data + 32)));
+		x3 = _mm_xor_si128(Crc64Fold(x3, fold512), _mm_loadu_si128((const __m128i*) (data + 48)));
+	}
+
+	x0 = _mm_xor_si128(Crc64Fold(x0, fold128), x1);
+	x0 = _mm_xor_si128(Crc64Fold(x0, fold128), x2);
+	x0 = _mm_xor_si128(Crc64Fold(x0, fold128), x3);
+	for (; len >= 16; data += 16, len -= 16)
+		x0 = _mm_xor_si128(Crc64Fold(x0, fold128), _mm_loadu_si128((const __m128i*) data));
+
+	_mm_store_si128((__m128i*) remainder, x0);
+	return Crc64Table(Crc64Table(0, remainder, sizeof(remainder)), data, len);
+}
+
+#endif
+
+uint32 CRC32C_update(uint32 crc, const byte *data, size_t len)
+{
+	crc = ~crc;
+#ifdef CRC_SSE42_AVAILABLE
+	if (HasSSE42())
+		crc = Crc32cSse42(crc, data, len);
+	else
+#endif
+		crc = Crc32cTable(crc, data, len);
+	return ~crc;
+}
+
+uint64 CRC64_update(uint64 crc, const byte *data, size_t len)
+{
+	crc = ~crc;
+#ifdef CRC_CLMUL_AVAILABLE
+	if (HasCLMUL())
+		crc = Crc64Clmul(crc, data, len);
+	else
+#endif
+		crc = Crc64Table(crc, data, len);
+	return ~crc;
+}
@@ -0,0 +1,33 @@
+/*
+* CRC-32C (Castagnoli, as used by iSCSI and ext4) and CRC-64/XZ (ECMA-182
+* polynomial, reflected, as used by xz) for fast integrity checks.
+*
+* Both use the zlib conventions: start with 0, feed the data in any number
+* of calls, the value returned after the last call is the CRC.
+*
+* Crc_init must be called once before any other function, after the CPU
+* features have been detected: CRC-32C then uses the SSE4.2 crc32
+* instruction and CRC-64 the PCLMULQDQ instruction when they are available.
+*/
+
+#ifndef CRC_H
+#define CRC_H
+
+#include "defs.h"
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Crc_init(void);
+
+uint32 CRC32C_update(uint32 crc, const byte *data, size_t len);
+
+uint64 CRC64_update(uint64 crc, const byte *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/*
+* Text encodings of digest values.
+*
+* Encoding is driven by tables: the two hexadecimal digits of each byte
+* value are looked up at once, and base64/base32 characters are taken from
+* their alphabet by index.
+*/
+
+#include "DigestCodec.h"
+
+static const char g_hexUpper[513] =
+	"000102030405060708090A0B0C0D0E0F"
+	"101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F"
+	"303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F"
+	"505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F"
+	"707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F"
+	"909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+	"B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+	"D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+	"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+static const char g_hexLower[513] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char g_base64Alphabet[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char g_base32Alphabet[33] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+size_t DigestToHex(const unsigned char* pbData, size_t cbData, wchar_t* szOut, int bLowerCase)
+{
+	const char* table = bLowerCase? g_hexLower : g_hexUpper;
+	size_t i;
+
+	for (i = 0; i < cbData; i++)
+	{
+		const char* pair = &table[2 * pbData[i]];
+		szOut[2 * i] = (wchar_t) pair[0];
+		szOut[2 * i + 1] = (wchar_t) pair[1];
+	}
+	szOut[2 * cbData] = 0;
+	return 2 * cbData;
+}
+
+size_t DigestToBase64(const unsigned char* pbData, size_t cbData, wchar_t* szOut)
+{
+	size_t i, cch = 0;
+
+	for (i = 0; i + 3 <= cbData; i += 3)
+	{
+		unsigned long v = ((unsigned long) pbData[i] << 16) | ((unsigned long) pbData[i + 1] << 8) | pbData[i + 2];
+		szOut[cch++] = (wchar_t) g_base64Alphabet[(v >> 18) & 0x3F];
+		szOut[cch++] = (wchar_t) g_base64Alphabet[(v >> 12) & 0x3F];
+		szOut[cch++] = (wchar_t) g_base64Alphabet[(v >> 6) & 0x3F];
+		szOut[cch++] = (wchar_t) g_base64Alphabet[v & 0x3F];
+	}
+
+	if (i < cbData)
+	{
+		unsigned long v = (unsigned long) pbData[i] << 16;
+		if (i + 1 < cbData)
+			v |= (unsigned long) pbData[i + 1] << 8;
+		szOut[cch++] = (wchar_t) g_base64Alphabet[(v >> 18) & 0x3F];
+		szOut[cch++] = (wchar_t) g_base64Alphabet[(v >> 12) & 0x3F];
+		szOut[cch++] = (i + 1 < cbData)? (wchar_t) g_base64Alphabet[(v >> 6) & 0x3F] : L'=';
+		szOut[cch++] = L'=';
+	}
+
+	szOut[cch] = 0;
+	return cch;
+}
+
+/* number of significant characters in a base32 group according to the number of bytes it holds */
+static const size_t g_base32GroupChars[6] = { 0, 2, 4, 5, 7, 8 };
+
+size_t DigestToBase32(const unsigned char* pbData, size_t cbData, wchar_t* szOut)
+{
+	size_t i, j, cch = 0;
+
+	for (i = 0; i < cbData; i += 5)
+	{
+		size_t cbGroup = (cbData - i < 5)? cbData - i : 5;
+		unsigned long long v = 0;
+
+		for (j = 0; j < 5; j++)
+			v = (v << 8) | ((j < cbGroup)? pbData[i + j] : 0);
+
+		for (j = 0; j < 8; j++)
+			szOut[cch + j] = (j < g_base32GroupChars[cbGroup])? (wchar_t) g_base32Alphabet[(v >> (35 - 5 * j)) & 0x1F] : L'=';
+		cch += 8;
+	}
+
+	szOut[cch] = 0;
+	return cch;
+}
+
+size_t DigestEncode(DigestEncoding encoding, const unsigned char* pbData, size_t cbData, wchar_t* szOut)
+{
+	switch (encoding)
+	{
+	case DIGEST_ENCODING_HEX_LOWER: return DigestToHex(pbData, cbData, szOut, 1);
+	case DIGEST_ENCODING_BASE64:    return DigestToBase64(pbData, cbData, szOut);
+	case DIGEST_ENCODING_BASE32:    return DigestToBase32(pbData, cbData, szOut);
+	default:                        return DigestToHex(pbData, cbData, szOut, 0);
+	}
+}
@@ -0,0 +1,40 @@
+/*
+* Text encodings of digest values: hexadecimal (upper or lower case),
+* base64 (RFC 4648 section 4) and base32 (RFC 4648 section 6).
+*
+* Encoders write a null terminated string and return its length.
+*/
+
+#ifndef DIGEST_CODEC_H
+#define DIGEST_CODEC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+	DIGEST_ENCODING_HEX_UPPER = 0,
+	DIGEST_ENCODING_HEX_LOWER,
+	DIGEST_ENCODING_BASE64,
+	DIGEST_ENCODING_BASE32
+} DigestEncoding;
+
+/* maximum number of characters, terminator included, needed to encode cbData bytes */
+#define DIGEST_ENCODED_MAX_CHARS(cbData)	(2 * (cbData) + 1 > 8 * (((cbData) + 4) / 5) + 1? 2 * (cbData) + 1 : 8 * (((cbData) + 4) / 5) + 1)
+
+size_t DigestEncode(DigestEncoding encoding, const unsigned char* pbData, size_t cbData, wchar_t* szOut);
+
+size_t DigestToHex(const unsigned char* pbData, size_t cbData, wchar_t* szOut, int bLowerCase);
+
+size_t DigestToBase64(const unsigned char* pbData, size_t cbData, wchar_t* szOut);
+
+size_t DigestToBase32(const unsigned char* pbData, size_t cbData, wchar_t* szOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,24 +34,73 @@
 #include <tchar.h>
 #include <io.h>
 #include <time.h>
+#include <errno.h>
 #include <strsafe.h>
+#include <winhttp.h>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
 #include <list>
+#include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
 #ifdef USE_STREEBOG
 #include "Streebog.h"
 #endif
+#include "DigestCodec.h"
+#include "KangarooTwelve.h"
+#include "cpu.h"
+#include "Crc.h"
 using namespace std;
 
 
 static BYTE g_pbBuffer[4096];
-static TCHAR g_szCanonalizedName[MAX_PATH + 1];
 static WORD  g_wAttributes = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED;
 static HANDLE g_hConsole = NULL;
 static CONSOLE_SCREEN_BUFFER_INFO g_originalConsoleInfo;
 static BYTE pbDigest[128];
-static TCHAR szDigestHex[257];
+static TCHAR szDigestHex[DIGEST_ENCODED_MAX_CHARS(sizeof(pbDigest))];
+static DigestEncoding g_digestEncoding = DIGEST_ENCODING_HEX_UPPER;
 static FILE* outputFile = NULL;
+static bool g_bNormalizeNames = false;
+
+// Digest profiles define how names are encoded and how directory entries are
+// ordered. See README.md for their exact definition.
+enum DigestProfile
+{
+	PROFILE_WINDOWS,	// UTF-16LE names, '\' separators, _wcsicmp order (historical DirHash digests)
+	PROFILE_PORTABLE	// NFC UTF-8 names relative to the input, '/' separators, code point order
+};
+#define PORTABLE_PROFILE_VERSION 1
+
+static DigestProfile g_profile = PROFILE_WINDOWS;
+static wstring g_szRootName;
+
+// Cancellation (Ctrl+C or -timeout) is cooperative: the enumeration and read
+// loops poll CheckCancellation and unwind with its error code. What was
+// completed up to that point is then reported by ShowPartialReport.
+static volatile LONG g_lCancelRequests = 0;
+static DWORD g_dwStartTicks = 0;
+static DWORD g_dwTimeout = 0;
+static unsigned long long g_ullFilesDone = 0;
+static unsigned long long g_ullBytesDone = 0;
+static wstring g_szLastFileDone;
+static bool g_bQuietReport = false;		// -quiet: no report on the console
+static bool g_bSumReport = false;		// -sum: report written as comments, which checksum verifiers skip
+
+// With -continue, I/O errors are recorded (and written to the -errors manifest)
+// instead of stopping the run, and the final result is marked as partial.
+// Transient errors are retried up to g_iMaxRetries times with a growing delay.
+// Fatal errors exit with their Win32 code, so the partial result code has the
+// customer bit (0x20000000) set in order to never be confused with one of them.
+#define DIRHASH_EXIT_PARTIAL 0x20000001
+static bool g_bContinueOnError = false;
+static int g_iMaxRetries = 0;
+static FILE* g_errorFile = NULL;
+static unsigned long long g_ullErrorCount = 0;
+static DWORD g_dwIoTimeout = 0;
 
 // Used for sorting directory content
 bool compare_nocase (LPCWSTR first, LPCWSTR second)
@@ -59,26 +108,107 @@ bool compare_nocase (LPCWSTR first, LPCWSTR second)
 	return _wcsicmp(first, second) < 0;
 }
 
-TCHAR ToHex(unsigned char b)
+// ---------------------------------------------
+// Name normalization used by -normalize: names are converted to Unicode NFC
+// and ASCII letters are folded to lower case, which is exactly the folding
+// that _wcsicmp (and thus compare_nocase) applies in the "C" locale. The
+// result is hashed as UTF-8 so that the same tree gives the same digest
+// whether its names were stored composed (Windows) or decomposed (macOS).
+
+#define DIRHASH_NORM_FORM_C 1
+typedef int (WINAPI *NormalizeStringFn)(int NormForm, LPCWSTR lpSrcString, int cwSrcLength, LPWSTR lpDstString, int cwDstLength);
+
+static NormalizeStringFn g_pfnNormalizeString = NULL;
+static wstring g_szNormalizedName;
+static wstring g_szPortableName;
+static string g_szUtf8Name;
+
+static const unsigned char g_asciiFold[128] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+	0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
+};
+
+// NormalizeString is only available starting from Vista (or XP with the
+// IDN download), so it is loaded dynamically to keep older systems working.
+bool LoadNormalization()
+{
+	if (!g_pfnNormalizeString)
+	{
+		HMODULE hNormaliz = LoadLibrary(_T("Normaliz.dll"));
+		if (hNormaliz)
+			g_pfnNormalizeString = (NormalizeStringFn) GetProcAddress(hNormaliz, "NormalizeString");
+	}
+	return g_pfnNormalizeString != NULL;
+}
+
+void NormalizeName(LPCWSTR szName, wstring& normalized, bool bFoldCase = true)
 {
-	if (b >= 0 && b <= 9)
-		return _T('0') + b;
-	else if (b >= 10 && b <= 15)
-		return _T('A') + b - 10;
+	size_t i, len = wcslen(szName);
+
+	// Characters below U+0300 are never altered by NFC unless followed by
+	// a combining mark, which is itself above U+0300
+	for (i = 0; i < len && szName[i] < 0x0300; i++);
+
+	if (i == len || !g_pfnNormalizeString)
+		normalized.assign(szName, len);
 	else
-		return _T('X');
+	{
+		int cchResult = g_pfnNormalizeString(DIRHASH_NORM_FORM_C, szName, (int) len, NULL, 0);
+		normalized.clear();
+		while (cchResult > 0)
+		{
+			normalized.resize(cchResult);
+			cchResult = g_pfnNormalizeString(DIRHASH_NORM_FORM_C, szName, (int) len, &normalized[0], cchResult);
+			if (cchResult > 0)
+			{
+				normalized.resize(cchResult);
+				break;
+			}
+			if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+				break;
+			// the returned value is the negated estimate of the needed size
+			cchResult = -cchResult;
+		}
+
+		// invalid sequences (e.g. unpaired surrogates) are used as is
+		if (cchResult <= 0)
+			normalized.assign(szName, len);
+	}
+
+	if (bFoldCase)
+	{
+		for (i = 0; i < normalized.length(); i++)
+		{
+			if (normalized[i] < 0x80)
+				normalized[i] = g_asciiFold[normalized[i]];
+		}
+	}
 }
 
-void ToHex(LPBYTE pbData, int iLen, LPTSTR szHex)
+// Compare two UTF-16 strings in Unicode code point order. Plain code unit
+// comparison would wrongly sort supplementary characters (surrogate pairs)
+// before U+E000..U+FFFF.
+int CompareCodePoints(LPCWSTR first, LPCWSTR second)
 {
-	unsigned char b;
-	for (int i=0; i < iLen; i++)
+	while (*first && (*first == *second))
+	{
+		first++;
+		second++;
+	}
+
+	unsigned int c1 = *first, c2 = *second;
+	if (c1 >= 0xD800 && c2 >= 0xD800)
 	{
-		b = *pbData++;
-		*szHex++ = ToHex(b >> 4);
-		*szHex++ = ToHex(b & 0x0F);
+		c1 = (c1 >= 0xE000)? c1 - 0x800 : c1 + 0x2000;
+		c2 = (c2 >= 0xE000)? c2 - 0x800 : c2 + 0x2000;
 	}
-	*szHex = 0;
+	return (int) c1 - (int) c2;
 }
 
 // ---------------------------------------------
@@ -86,11 +216,16 @@ void ToHex(LPBYTE pbData, int iLen, LPTSTR szHex)
 class Hash
 {
 public:
+	virtual ~Hash() {}
 	virtual void Init() = 0;
 	virtual void Update(LPCBYTE pbData, size_t dwLength) = 0;
 	virtual void Final(LPBYTE pbDigest) = 0;
 	virtual int GetHashSize() = 0;
 	virtual LPCTSTR GetID() = 0;
+	// name of the external provider computing the hash, NULL for built-in implementations
+	virtual LPCTSTR GetBackend() { return NULL;}
+	// non zero when an external provider failed since Init: the digest given by Final is then not valid
+	virtual DWORD GetError() { return 0;}
 	static Hash* GetHash(LPCTSTR szHashId);
 };
 
@@ -179,6 +314,117 @@ public:
 	int GetHashSize() { return 64;}
 };
 
+// SHA-512/t (FIPS 180-4 section 5.3.6): SHA-512 with its own initial value,
+// truncated to t bits. On 64-bit CPUs without SHA extensions it runs at the
+// speed of SHA-512, which is faster per byte than SHA-256.
+class Sha512Truncated : public Hash
+{
+protected:
+	SHA512_CTX m_ctx;
+	const SHA_LONG64* m_pIV;
+	int m_cbDigest;
+	LPCTSTR m_szID;
+public:
+	Sha512Truncated(const SHA_LONG64* pIV, int cbDigest, LPCTSTR szID) : Hash(), m_pIV(pIV), m_cbDigest(cbDigest), m_szID(szID)
+	{
+		Init();
+	}
+
+	void Init() 
+	{
+		SHA512_Init(&m_ctx);
+		memcpy(m_ctx.h, m_pIV, sizeof(m_ctx.h));
+	}
+	void Update(LPCBYTE pbData, size_t dwLength) { SHA512_Update(&m_ctx, pbData, dwLength);}
+	void Final(LPBYTE pbDigest)
+	{
+		unsigned char pbFull[SHA512_DIGEST_LENGTH];
+		SHA512_Final(pbFull, &m_ctx);
+		memcpy(pbDigest, pbFull, m_cbDigest);
+		SecureZeroMemory(pbFull, sizeof(pbFull));
+	}
+	LPCTSTR GetID() { return m_szID;}
+	int GetHashSize() { return m_cbDigest;}
+};
+
+static const SHA_LONG64 g_sha512_256IV[8] = {
+	U64(0x22312194FC2BF72C), U64(0x9F555FA3C84C64C2), U64(0x2393B86B6F53B151), U64(0x963877195940EABD),
+	U64(0x96283EE2A88EFFE3), U64(0xBE5E1E2553863992), U64(0x2B0199FC2C85B8AA), U64(0x0EB72DDC81C52CA2)
+};
+
+static const SHA_LONG64 g_sha512_224IV[8] = {
+	U64(0x8C3D37C819544DA2), U64(0x73E1996689DCD4D6), U64(0x1DFAB7AE32FF9C82), U64(0x679DD514582F9FCF),
+	U64(0x0F6D2B697BD44DA8), U64(0x77E36F7304C48942), U64(0x3F9D85A86A1D36C8), U64(0x1112E6AD91D692A1)
+};
+
+class Sha512_256 : public Sha512Truncated
+{
+public:
+	Sha512_256() : Sha512Truncated(g_sha512_256IV, 32, _T("SHA512_256")) {}
+};
+
+class Sha512_224 : public Sha512Truncated
+{
+public:
+	Sha512_224() : Sha512Truncated(g_sha512_224IV, 28, _T("SHA512_224")) {}
+};
+
+class KangarooTwelve : public Hash
+{
+protected:
+	K12_CTX m_ctx;
+public:
+	KangarooTwelve() : Hash() 
+	{
+		K12_init(&m_ctx);
+	}
+
+	void Init() { K12_init(&m_ctx);}
+	void Update(LPCBYTE pbData, size_t dwLength) { K12_add(&m_ctx, pbData, dwLength);}
+	void Final(LPBYTE pbDigest) { K12_finalize(&m_ctx, pbDigest);}
+	LPCTSTR GetID() { return _T("K12");}
+	int GetHashSize() { return K12_DIGEST_SIZE;}
+};
+
+// CRCs only detect accidental corruption: they are meant for scrubbing, not
+// for checking data against tampering. Values are written in big endian
+// order, as usually displayed.
+class Crc32c : public Hash
+{
+protected:
+	uint32 m_crc;
+public:
+	Crc32c() : Hash(), m_crc(0) {}
+
+	void Init() { m_crc = 0;}
+	void Update(LPCBYTE pbData, size_t dwLength) { m_crc = CRC32C_update(m_crc, pbData, dwLength);}
+	void Final(LPBYTE pbDigest)
+	{
+		for (int i = 0; i < 4; i++)
+			pbDigest[i] = (BYTE) (m_crc >> (24 - 8 * i));
+	}
+	LPCTSTR GetID() { return _T("CRC32C");}
+	int GetHashSize() { return 4;}
+};
+
+class Crc64 : public Hash
+{
+protected:
+	uint64 m_crc;
+public:
+	Crc64() : Hash(), m_crc(0) {}
+
+	void Init() { m_crc = 0;}
+	void Update(LPCBYTE pbData, size_t dwLength) { m_crc = CRC64_update(m_crc, pbData, dwLength);}
+	void Final(LPBYTE pbDigest)
+	{
+		for (int i = 0; i < 8; i++)
+			pbDigest[i] = (BYTE) (m_crc >> (56 - 8 * i));
+	}
+	LPCTSTR GetID() { return _T("CRC64");}
+	int GetHashSize() { return 8;}
+};
+
 #ifdef USE_STREEBOG
 class Streebog : public Hash
 {
@@ -198,343 +444,4463 @@ public:
 };
 #endif
 
-Hash* Hash::GetHash(LPCTSTR szHashId)
+// ---------------------------------------------
+// -backend cng: hashes computed by Windows CNG (bcrypt.dll), which uses the
+// hardware or kernel providers installed on the system. bcrypt.dll only
+// exists from Vista on, so it is loaded dynamically; algorithms that CNG
+// does not provide keep their built-in implementation. Digests are identical.
+
+enum HashBackend
+{
+	BACKEND_BUILTIN,
+	BACKEND_CNG,
+	BACKEND_AUTO		// fastest of the above, see SelectBackend
+};
+
+static HashBackend g_hashBackend = BACKEND_BUILTIN;
+
+typedef LONG (WINAPI *BCryptOpenAlgorithmProviderFn)(PVOID* phAlgorithm, LPCWSTR pszAlgId, LPCWSTR pszImplementation, ULONG dwFlags);
+typedef LONG (WINAPI *BCryptGetPropertyFn)(PVOID hObject, LPCWSTR pszProperty, PUCHAR pbOutput, ULONG cbOutput, ULONG* pcbResult, ULONG dwFlags);
+typedef LONG (WINAPI *BCryptCreateHashFn)(PVOID hAlgorithm, PVOID* phHash, PUCHAR pbHashObject, ULONG cbHashObject, PUCHAR pbSecret, ULONG cbSecret, ULONG dwFlags);
+typedef LONG (WINAPI *BCryptHashDataFn)(PVOID hHash, PUCHAR pbInput, ULONG cbInput, ULONG dwFlags);
+typedef LONG (WINAPI *BCryptFinishHashFn)(PVOID hHash, PUCHAR pbOutput, ULONG cbOutput, ULONG dwFlags);
+typedef LONG (WINAPI *BCryptDestroyHashFn)(PVOID hHash);
+
+static BCryptCreateHashFn g_pfnBCryptCreateHash = NULL;
+static BCryptHashDataFn g_pfnBCryptHashData = NULL;
+static BCryptFinishHashFn g_pfnBCryptFinishHash = NULL;
+static BCryptDestroyHashFn g_pfnBCryptDestroyHash = NULL;
+
+struct CCngAlgorithm
 {
-	if (!szHashId || (_tcsicmp(szHashId, _T("SHA1")) == 0))
+	LPCTSTR szID;			// same identifiers as the built-in implementations
+	LPCWSTR szCngID;
+	int cbDigest;
+	PVOID hAlgorithm;
+	ULONG cbHashObject;
+};
+
+static CCngAlgorithm g_cngAlgorithms[] = {
+	{ _T("MD5"), L"MD5", 16, NULL, 0 },
+	{ _T("SHA1"), L"SHA1", 20, NULL, 0 },
+	{ _T("SHA256"), L"SHA256", 32, NULL, 0 },
+	{ _T("SHA384"), L"SHA384", 48, NULL, 0 },
+	{ _T("SHA512"), L"SHA512", 64, NULL, 0 }
+};
+
+// Open all the algorithm providers once, on the main thread, so that hash
+// objects can then be created from any thread. Returns false if CNG is missing.
+bool LoadCng()
+{
+	HMODULE hBCrypt = LoadLibrary(_T("bcrypt.dll"));
+	if (!hBCrypt)
+		return false;
+
+	BCryptOpenAlgorithmProviderFn pfnOpenAlgorithmProvider = (BCryptOpenAlgorithmProviderFn) GetProcAddress(hBCrypt, "BCryptOpenAlgorithmProvider");
+	BCryptGetPropertyFn pfnGetProperty = (BCryptGetPropertyFn) GetProcAddress(hBCrypt, "BCryptGetProperty");
+	g_pfnBCryptCreateHash = (BCryptCreateHashFn) GetProcAddress(hBCrypt, "BCryptCreateHash");
+	g_pfnBCryptHashData = (BCryptHashDataFn) GetProcAddress(hBCrypt, "BCryptHashData");
+	g_pfnBCryptFinishHash = (BCryptFinishHashFn) GetProcAddress(hBCrypt, "BCryptFinishHash");
+	g_pfnBCryptDestroyHash = (BCryptDestroyHashFn) GetProcAddress(hBCrypt, "BCryptDestroyHash");
+	if (!pfnOpenAlgorithmProvider || !pfnGetProperty || !g_pfnBCryptCreateHash || !g_pfnBCryptHashData || !g_pfnBCryptFinishHash || !g_pfnBCryptDestroyHash)
+		return false;
+
+	for (int i = 0; i < ARRAYSIZE(g_cngAlgorithms); i++)
 	{
-		return new Sha1();
+		ULONG cbResult;
+		CCngAlgorithm& algorithm = g_cngAlgorithms[i];
+		if (pfnOpenAlgorithmProvider(&algorithm.hAlgorithm, algorithm.szCngID, NULL, 0) < 0)
+			algorithm.hAlgorithm = NULL;
+		else if (pfnGetProperty(algorithm.hAlgorithm, L"ObjectLength", (PUCHAR) &algorithm.cbHashObject, sizeof(ULONG), &cbResult, 0) < 0)
+			algorithm.hAlgorithm = NULL;	// the provider stays open until the process exits
 	}
-	if (_tcsicmp(szHashId, _T("SHA256")) == 0)
+	return true;
+}
+
+class CngHash : public Hash
+{
+protected:
+	const CCngAlgorithm& m_algorithm;
+	PVOID m_hHash;
+	vector<UCHAR> m_hashObject;
+	DWORD m_dwError;		// first NTSTATUS failure since Init
+
+	void Destroy()
 	{
-		return new Sha256();
+		if (m_hHash)
+		{
+			g_pfnBCryptDestroyHash(m_hHash);
+			m_hHash = NULL;
+		}
 	}
-	if (_tcsicmp(szHashId, _T("SHA384")) == 0)
+public:
+	CngHash(const CCngAlgorithm& algorithm) : Hash(), m_algorithm(algorithm), m_hHash(NULL), m_hashObject(algorithm.cbHashObject), m_dwError(0)
 	{
-		return new Sha384();
+		Init();
 	}
-	if (_tcsicmp(szHashId, _T("SHA512")) == 0)
+
+	~CngHash() { Destroy();}
+
+	void Init()
 	{
-		return new Sha512();
+		LONG status;
+		Destroy();
+		status = g_pfnBCryptCreateHash(m_algorithm.hAlgorithm, &m_hHash, m_hashObject.empty()? NULL : &m_hashObject[0], (ULONG) m_hashObject.size(), NULL, 0, 0);
+		m_dwError = (status < 0)? (DWORD) status : 0;
+		if (m_dwError)
+			m_hHash = NULL;
 	}
-	if (_tcsicmp(szHashId, _T("MD5")) == 0)
+	void Update(LPCBYTE pbData, size_t dwLength)
 	{
-		return new Md5();
+		while (dwLength && !m_dwError)
+		{
+			ULONG cbChunk = (dwLength > 0x40000000)? 0x40000000 : (ULONG) dwLength;
+			LONG status = g_pfnBCryptHashData(m_hHash, (PUCHAR) pbData, cbChunk, 0);
+			if (status < 0)
+				m_dwError = (DWORD) status;
+			pbData += cbChunk;
+			dwLength -= cbChunk;
+		}
 	}
-#ifdef USE_STREEBOG
-	if (_tcsicmp(szHashId, _T("Streebog")) == 0)
+	void Final(LPBYTE pbDigest)
 	{
-		return new Streebog();
+		if (!m_dwError)
+		{
+			LONG status = g_pfnBCryptFinishHash(m_hHash, pbDigest, m_algorithm.cbDigest, 0);
+			if (status < 0)
+				m_dwError = (DWORD) status;
+		}
+		// the digest is only valid when GetError returns 0
+		if (m_dwError)
+			ZeroMemory(pbDigest, m_algorithm.cbDigest);
 	}
-#endif
-	return NULL;
-}
+	DWORD GetError() { return m_dwError;}
+	LPCTSTR GetID() { return m_algorithm.szID;}
+	int GetHashSize() { return m_algorithm.cbDigest;}
+	LPCTSTR GetBackend() { return _T("CNG");}
+};
 
-// ----------------------------------------------------------
+// ---------------------------------------------
+// Registry of the hash implementations. An algorithm can have one
+// implementation per backend; the built-in one always exists and is used
+// whenever the selected backend does not provide the algorithm.
 
-class CDirContent
+template<class T> Hash* CreateHash() { return new T();}
+
+template<int iAlgorithm> Hash* CreateCngHash()
 {
-protected:
-	wstring m_szPath;
-	bool m_bIsDir;
-public:
-	CDirContent(LPCWSTR szPath, LPCWSTR szName, bool bIsDir) : m_bIsDir(bIsDir), m_szPath(szPath)
-	{
-		if (szPath[wcslen(szPath) - 1] == _T('/'))
-			m_szPath[wcslen(szPath) - 1] = _T('\\');
+	return g_cngAlgorithms[iAlgorithm].hAlgorithm? new CngHash(g_cngAlgorithms[iAlgorithm]) : NULL;
+}
 
-		if (szPath[wcslen(szPath) - 1] != _T('\\'))
-			m_szPath += _T("\\");
-		m_szPath += szName;
-	}
+struct CHashImplementation
+{
+	LPCTSTR szID;
+	HashBackend backend;
+	Hash* (*pfnCreate)();	// returns NULL when not available on this system
+};
 
-	CDirContent(const CDirContent& content) : m_bIsDir(content.m_bIsDir), m_szPath(content.m_szPath) {}
+static const CHashImplementation g_hashImplementations[] = {
+	{ _T("MD5"), BACKEND_BUILTIN, &CreateHash<Md5> },
+	{ _T("MD5"), BACKEND_CNG, &CreateCngHash<0> },
+	{ _T("SHA1"), BACKEND_BUILTIN, &CreateHash<Sha1> },
+	{ _T("SHA1"), BACKEND_CNG, &CreateCngHash<1> },
+	{ _T("SHA256"), BACKEND_BUILTIN, &CreateHash<Sha256> },
+	{ _T("SHA256"), BACKEND_CNG, &CreateCngHash<2> },
+	{ _T("SHA384"), BACKEND_BUILTIN, &CreateHash<Sha384> },
+	{ _T("SHA384"), BACKEND_CNG, &CreateCngHash<3> },
+	{ _T("SHA512"), BACKEND_BUILTIN, &CreateHash<Sha512> },
+	{ _T("SHA512"), BACKEND_CNG, &CreateCngHash<4> },
+	{ _T("SHA512_256"), BACKEND_BUILTIN, &CreateHash<Sha512_256> },
+	{ _T("SHA512_224"), BACKEND_BUILTIN, &CreateHash<Sha512_224> },
+	{ _T("K12"), BACKEND_BUILTIN, &CreateHash<KangarooTwelve> },
+	{ _T("CRC32C"), BACKEND_BUILTIN, &CreateHash<Crc32c> },
+	{ _T("CRC64"), BACKEND_BUILTIN, &CreateHash<Crc64> },
+#ifdef USE_STREEBOG
+	{ _T("Streebog"), BACKEND_BUILTIN, &CreateHash<Streebog> },
+#endif
+};
 
-	bool IsDir() const { return m_bIsDir;}
-	LPCWSTR GetPath() const { return m_szPath.c_str();}
-	operator LPCWSTR () { return m_szPath.c_str();}
+// other names accepted on the command line
+static const LPCTSTR g_hashAliases[][2] = {
+	{ _T("SHA512/256"), _T("SHA512_256") },
+	{ _T("SHA512/224"), _T("SHA512_224") },
+	{ _T("KangarooTwelve"), _T("K12") }
 };
 
-bool IsExcludedName(LPCTSTR szName, list<wstring>& excludeSpecList)
-{
-	for (list<wstring>::iterator It = excludeSpecList.begin(); It != excludeSpecList.end(); It++)
-	{
-		if (PathMatchSpec (szName, It->c_str()))
-			return true;
-	}
+// backend chosen by -backend auto for each algorithm, filled before hashing starts
+static map<wstring, HashBackend> g_calibratedBackends;
 
-	return false;
+LPCTSTR GetBackendName(HashBackend backend)
+{
+	return (backend == BACKEND_CNG)? _T("cng") : _T("builtin");
 }
 
-// return the file name. If it is too long, it is shortness so that the progress line 
-LPCTSTR GetShortFileName (LPCTSTR szFilePath, unsigned long long fileSize)
+// Canonical identifier of an algorithm name given by the user, NULL if unknown
+LPCTSTR GetHashID(LPCTSTR szHashId)
 {
-	static TCHAR szShortName[256];
-	size_t l, bufferSize = ARRAYSIZE (szShortName);
-	int maxPrintLen = _scprintf (" [==========] 100.00 %% (%ull/%ull)", fileSize, fileSize); // 10 steps for progress bar
-	LPCTSTR ptr = &szFilePath [_tcslen (szFilePath) - 1];
-
-	// Get file name part from the path
-	while ((ptr != szFilePath) && (*ptr != _T('\\')) && (*ptr != _T('/')))
+	if (!szHashId)
+		return _T("SHA1");
+	for (int i = 0; i < ARRAYSIZE(g_hashAliases); i++)
 	{
-		ptr--;
+		if (_tcsicmp(szHashId, g_hashAliases[i][0]) == 0)
+			return g_hashAliases[i][1];
 	}
-	ptr++;
-
-	// calculate maximum length for file name	
-	bufferSize = (g_originalConsoleInfo.dwSize.X > (maxPrintLen+1))? min (256, (g_originalConsoleInfo.dwSize.X - 1 - maxPrintLen)) : 9;
-
-	l = _tcslen (ptr);
-	if (l < bufferSize)
-		_tcscpy (szShortName, ptr);
-	else
+	for (int i = 0; i < ARRAYSIZE(g_hashImplementations); i++)
 	{
-		size_t prefixLen = (bufferSize / 2 - 2);
-		size_t suffixLen = bufferSize - prefixLen - 4;
-
-		memcpy (szShortName, ptr, prefixLen * sizeof (TCHAR));
-		memcpy (((unsigned char*) szShortName) + prefixLen * sizeof (TCHAR), _T("..."), 3 * sizeof (TCHAR));
-		memcpy (((unsigned char*) szShortName) + (prefixLen + 3)* sizeof (TCHAR), ptr + (l - suffixLen), suffixLen * sizeof (TCHAR));
-		szShortName [bufferSize - 1] = 0;
+		if (_tcsicmp(szHashId, g_hashImplementations[i].szID) == 0)
+			return g_hashImplementations[i].szID;
 	}
-	return szShortName;
+	return NULL;
 }
 
-void DisplayProgress (LPCTSTR szFileName, unsigned long long currentSize, unsigned long long fileSize, clock_t startTime, clock_t &lastBlockTime)
+Hash* CreateHash(LPCTSTR szID, HashBackend backend)
 {
-	clock_t t = clock ();
-	if (lastBlockTime == 0 || currentSize == fileSize || ((t - lastBlockTime) >= CLOCKS_PER_SEC))
+	for (int i = 0; i < ARRAYSIZE(g_hashImplementations); i++)
 	{
-		unsigned long long maxPos = 10ull;
-		unsigned long long pos = (currentSize * maxPos) / fileSize;
-		double pourcentage = ((double) currentSize / (double) fileSize) * 100.0;
+		if (g_hashImplementations[i].backend == backend && _tcscmp(szID, g_hashImplementations[i].szID) == 0)
+			return g_hashImplementations[i].pfnCreate();
+	}
+	return NULL;
+}
 
-		lastBlockTime = t;
+Hash* Hash::GetHash(LPCTSTR szHashId)
+{
+	Hash* pHash = NULL;
+	HashBackend backend = g_hashBackend;
+	LPCTSTR szID = GetHashID(szHashId);
 
-		_tprintf (_T("\r%s ["), szFileName);
-		for (unsigned long long i = 0; i < maxPos; i++)
-		{
-			if (i < pos)
-				_tprintf (_T("="));
-			else
-				_tprintf (_T(" "));
-		}
-		_tprintf (_T("] %.2f %% (%llu/%llu)"), pourcentage, currentSize, fileSize);
+	if (!szID)
+		return NULL;
 
-		_tprintf (_T("\r"));
+	if (backend == BACKEND_AUTO)
+	{
+		map<wstring, HashBackend>::const_iterator It = g_calibratedBackends.find(szID);
+		backend = (It != g_calibratedBackends.end())? It->second : BACKEND_BUILTIN;
 	}
+	if (backend != BACKEND_BUILTIN)
+		pHash = CreateHash(szID, backend);
+	if (!pHash)
+		pHash = CreateHash(szID, BACKEND_BUILTIN);
+	return pHash;
 }
 
-void ClearProgress ()
+// ---------------------------------------------
+// -backend auto: the implementations of the selected algorithm are timed on
+// a memory buffer and the fastest one is remembered in DirHash.ini, under
+// the local application data folder, together with the processor identifier
+// so that the calibration is redone when the file is used on another machine.
+
+#define CALIBRATION_BUFFER_SIZE	(1024 * 1024)
+#define CALIBRATION_DURATION	100	// milliseconds per implementation
+#define CALIBRATION_VERSION		1	// saved choices of other versions are measured again
+
+bool GetCalibrationFile(TCHAR szFile[MAX_PATH])
 {
-	_tprintf (_T("\r"));
-	for (int i = 0; i < g_originalConsoleInfo.dwSize.X - 1; i++)
-	{
-		_tprintf (_T(" "));
-	}
+	DWORD cch = GetEnvironmentVariable(_T("LOCALAPPDATA"), szFile, MAX_PATH);
+	if (!cch || cch >= MAX_PATH)
+		cch = GetEnvironmentVariable(_T("APPDATA"), szFile, MAX_PATH);	// Windows XP
+	if (!cch || cch >= MAX_PATH)
+		return false;
+	if (!PathAppend(szFile, _T("DirHash")))
+		return false;
+	CreateDirectory(szFile, NULL);
+	return PathAppend(szFile, _T("DirHash.ini")) ? true : false;
+}
 
-	_tprintf (_T("\r"));
+wstring GetProcessorIdentifier()
+{
+	TCHAR szIdentifier[256];
+	DWORD cch = GetEnvironmentVariable(_T("PROCESSOR_IDENTIFIER"), szIdentifier, ARRAYSIZE(szIdentifier));
+	return (cch && cch < ARRAYSIZE(szIdentifier))? szIdentifier : _T("");
 }
 
-DWORD HashFile(LPCTSTR szFilePath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress, bool bSumMode)
+// Throughput of an implementation in MB/s, 0 if it is not available
+// same block size as HashFile, since per call overhead differs between backends
+void HashCalibrationBuffer(Hash* pHash, LPCBYTE pbData)
 {
-	DWORD dwError = 0;
-	FILE* f = NULL;
-	int pathLen = lstrlen(szFilePath);
-	if (bSumMode)
-		pHash = Hash::GetHash (pHash->GetID());
+	for (size_t offset = 0; offset < CALIBRATION_BUFFER_SIZE; offset += sizeof(g_pbBuffer))
+		pHash->Update(pbData + offset, sizeof(g_pbBuffer));
+}
 
-	if (pathLen <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szFilePath, excludeSpecList))
+double MeasureHash(Hash* pHash, LPCBYTE pbData)
+{
+	BYTE pbDigest[128];
+	LARGE_INTEGER frequency, start, now;
+	ULONGLONG ullBytes = 0;
+
+	if (!QueryPerformanceFrequency(&frequency))
 		return 0;
 
-	if (bIncludeNames)
+	// first pass to warm up caches and lazily initialized code
+	HashCalibrationBuffer(pHash, pbData);
+	pHash->Final(pbDigest);
+	if (pHash->GetError())
+		return 0;
+
+	QueryPerformanceCounter(&start);
+	do
 	{
-		LPCTSTR pNameToHash = NULL;
-		if (pathLen > MAX_PATH)
-			pNameToHash = szFilePath;
-		else
-		{
-			g_szCanonalizedName[MAX_PATH] = 0;
-			if (!PathCanonicalize (g_szCanonalizedName, szFilePath))
-				lstrcpy (g_szCanonalizedName, szFilePath);
+		pHash->Init();
+		HashCalibrationBuffer(pHash, pbData);
+		pHash->Final(pbDigest);
+		ullBytes += CALIBRATION_BUFFER_SIZE;
+		QueryPerformanceCounter(&now);
+	} while ((now.QuadPart - start.QuadPart) * 1000 < frequency.QuadPart * CALIBRATION_DURATION);
 
-			if (bStripNames)
-				pNameToHash = PathFindFileName(g_szCanonalizedName);
-			else
-				pNameToHash = g_szCanonalizedName;  
-		}
+	return ((double) ullBytes / (1024.0 * 1024.0)) * (double) frequency.QuadPart / (double) (now.QuadPart - start.QuadPart);
+}
 
-		pHash->Update ((LPCBYTE) pNameToHash, _tcslen (pNameToHash) * sizeof(TCHAR));
+HashBackend CalibrateBackend(LPCTSTR szID, bool bQuiet)
+{
+	HashBackend bestBackend = BACKEND_BUILTIN;
+	double bestSpeed = 0;
+	int implementations = 0;
+
+	// nothing to measure for an algorithm with a single implementation
+	for (int i = 0; i < ARRAYSIZE(g_hashImplementations); i++)
+	{
+		if (_tcscmp(szID, g_hashImplementations[i].szID) == 0)
+			implementations++;
 	}
+	if (implementations < 2)
+		return BACKEND_BUILTIN;
 
-	f = _tfopen(szFilePath, _T("rb"));
-	if(f)
+	vector<BYTE> data(CALIBRATION_BUFFER_SIZE);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (BYTE) (i * 2654435761U >> 24);
+
+	for (int i = 0; i < ARRAYSIZE(g_hashImplementations); i++)
 	{
-		size_t len;
-		bShowProgress = !bQuiet && bShowProgress;
-		unsigned long long fileSize = bShowProgress? (unsigned long long) _filelengthi64 ( _fileno (f)) : 0;
-		unsigned long long currentSize = 0;
-		clock_t startTime = bShowProgress? clock () : 0;
-		clock_t lastBlockTime = 0;
-		LPCTSTR szFileName = bShowProgress? GetShortFileName (szFilePath, fileSize) : NULL;
+		if (_tcscmp(szID, g_hashImplementations[i].szID) != 0)
+			continue;
+
+		Hash* pHash = g_hashImplementations[i].pfnCreate();
+		if (!pHash)
+			continue;
+		double speed = MeasureHash(pHash, &data[0]);
+		delete pHash;
 
-		while (  (len = fread(g_pbBuffer, 1, sizeof(g_pbBuffer), f)) != 0)
+		if (!bQuiet)
+			_tprintf(_T("Calibration: %s with %s backend: %.0f MB/s\n"), szID, GetBackendName(g_hashImplementations[i].backend), speed);
+		if (speed > bestSpeed)
 		{
-			currentSize += (unsigned long long) len;
-			pHash->Update(g_pbBuffer, len);
-			if (bShowProgress)
-				DisplayProgress (szFileName, currentSize, fileSize, startTime, lastBlockTime);
+			bestSpeed = speed;
+			bestBackend = g_hashImplementations[i].backend;
 		}
+	}
+	return bestBackend;
+}
 
-		if (bShowProgress)
+// Choose the backend used for szID, from the calibration file unless bRecalibrate
+void SelectBackend(LPCTSTR szID, bool bRecalibrate, bool bQuiet)
+{
+	TCHAR szFile[MAX_PATH], szValue[64];
+	bool bHaveFile = GetCalibrationFile(szFile);
+	wstring szProcessor = GetProcessorIdentifier();
+
+	if (bHaveFile && !bRecalibrate)
+	{
+		GetPrivateProfileString(_T("Calibration"), _T("Processor"), _T(""), szValue, ARRAYSIZE(szValue), szFile);
+		if (szProcessor == szValue && GetPrivateProfileInt(_T("Calibration"), _T("Version"), 0, szFile) == CALIBRATION_VERSION)
+		{
+			GetPrivateProfileString(_T("Backends"), szID, _T(""), szValue, ARRAYSIZE(szValue), szFile);
+			if (_tcsicmp(szValue, GetBackendName(BACKEND_BUILTIN)) == 0 || _tcsicmp(szValue, GetBackendName(BACKEND_CNG)) == 0)
+			{
+				g_calibratedBackends[szID] = (_tcsicmp(szValue, GetBackendName(BACKEND_CNG)) == 0)? BACKEND_CNG : BACKEND_BUILTIN;
+				return;
+			}
+		}
+		else
+		{
+			// results measured on another processor or by another version are discarded
+			WritePrivateProfileString(_T("Backends"), NULL, NULL, szFile);
+		}
+	}
+
+	g_calibratedBackends[szID] = CalibrateBackend(szID, bQuiet);
+	if (bHaveFile)
+	{
+		StringCchPrintf(szValue, ARRAYSIZE(szValue), _T("%d"), CALIBRATION_VERSION);
+		WritePrivateProfileString(_T("Calibration"), _T("Processor"), szProcessor.c_str(), szFile);
+		WritePrivateProfileString(_T("Calibration"), _T("Version"), szValue, szFile);
+		WritePrivateProfileString(_T("Backends"), szID, GetBackendName(g_calibratedBackends[szID]), szFile);
+	}
+}
+
+// ----------------------------------------------------------
+
+class CDirContent
+{
+protected:
+	wstring m_szPath;
+	wstring m_szSortKey;
+	wstring m_szName;
+	size_t m_nameOffset;
+	bool m_bIsDir;
+	// metadata returned by the enumeration, so that later stages need no extra system call
+	unsigned long long m_size;
+	unsigned long long m_lastWriteTime;
+	DWORD m_dwAttributes;
+
+	void SetPath(LPCWSTR szPath, LPCWSTR szName)
+	{
+		m_szPath = szPath;
+		if (szPath[wcslen(szPath) - 1] == _T('/'))
+			m_szPath[wcslen(szPath) - 1] = _T('\\');
+
+		if (szPath[wcslen(szPath) - 1] != _T('\\'))
+			m_szPath += _T("\\");
+		m_nameOffset = m_szPath.length();
+		m_szPath += szName;
+
+		if (g_profile == PROFILE_PORTABLE)
+		{
+			NormalizeName(szName, m_szName, false);
+			NormalizeName(m_szName.c_str(), m_szSortKey);
+		}
+		else if (g_bNormalizeNames)
+			NormalizeName(szName, m_szSortKey);
+	}
+
+public:
+	CDirContent(LPCWSTR szPath, LPCWSTR szName, bool bIsDir, unsigned long long size = 0, unsigned long long lastWriteTime = 0) : m_bIsDir(bIsDir), m_size(size), m_lastWriteTime(lastWriteTime), m_dwAttributes(bIsDir? FILE_ATTRIBUTE_DIRECTORY : 0)
+	{
+		SetPath(szPath, szName);
+	}
+
+	CDirContent(LPCWSTR szPath, const WIN32_FIND_DATA& ffd)
+		:	m_bIsDir((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0),
+			m_size(((unsigned long long) ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow),
+			m_lastWriteTime(((unsigned long long) ffd.ftLastWriteTime.dwHighDateTime << 32) | ffd.ftLastWriteTime.dwLowDateTime),
+			m_dwAttributes(ffd.dwFileAttributes)
+	{
+		SetPath(szPath, ffd.cFileName);
+		if (m_bIsDir)
+			m_size = 0;
+	}
+
+	CDirContent(const CDirContent& content) : m_bIsDir(content.m_bIsDir), m_szPath(content.m_szPath), m_szSortKey(content.m_szSortKey), m_szName(content.m_szName), m_nameOffset(content.m_nameOffset), m_size(content.m_size), m_lastWriteTime(content.m_lastWriteTime), m_dwAttributes(content.m_dwAttributes) {}
+
+	bool IsDir() const { return m_bIsDir;}
+	unsigned long long GetSize() const { return m_size;}
+	unsigned long long GetLastWriteTime() const { return m_lastWriteTime;}
+	DWORD GetAttributes() const { return m_dwAttributes;}
+	LPCWSTR GetPath() const { return m_szPath.c_str();}
+	LPCWSTR GetName() const { return m_szPath.c_str() + m_nameOffset;}
+	LPCWSTR GetSortKey() const { return m_szSortKey.c_str();}
+	LPCWSTR GetNormalizedName() const { return m_szName.c_str();}
+	operator LPCWSTR () { return m_szPath.c_str();}
+};
+
+// Used for sorting directory content when -normalize is specified. Names
+// differing only by case or by composition have the same key: the exact
+// names then decide, so that the order never depends on the file system.
+bool compare_normalized (const CDirContent& first, const CDirContent& second)
+{
+	int result = wcscmp(first.GetSortKey(), second.GetSortKey());
+	if (result == 0)
+		result = CompareCodePoints(first.GetName(), second.GetName());
+	return result < 0;
+}
+
+// Used for sorting directory content with the portable profile: case folded
+// names first, then the NFC names, then the names as stored so that the
+// order is total
+bool compare_portable (const CDirContent& first, const CDirContent& second)
+{
+	int result = CompareCodePoints(first.GetSortKey(), second.GetSortKey());
+	if (result == 0)
+		result = CompareCodePoints(first.GetNormalizedName(), second.GetNormalizedName());
+	if (result == 0)
+		result = CompareCodePoints(first.GetName(), second.GetName());
+	return result < 0;
+}
+
+// Canonical path of the entry being hashed when -hashnames is specified. The
+// input path is canonicalized once, then components are pushed and popped as
+// the traversal goes down and up the tree. Since names returned by
+// FindFirstFile never contain "." or ".." parts, this gives the same result as
+// calling PathCanonicalize on every full path without rescanning them.
+class CNamePath
+{
+protected:
+	TCHAR m_szRoot[MAX_PATH + 1];
+	TCHAR m_szPath[32768];
+	size_t m_cchPrefix;
+	size_t m_cchPath;
+	size_t m_leafOffset;
+	size_t m_cchRawRoot;
+	size_t m_cchRawSeparator;
+public:
+	CNamePath() : m_cchPrefix(0), m_cchPath(0), m_leafOffset(0), m_cchRawRoot(0), m_cchRawSeparator(1)
+	{
+		m_szRoot[0] = 0;
+		m_szPath[0] = 0;
+	}
+
+	void SetRoot(LPCTSTR szRootPath)
+	{
+		TCHAR szChild[MAX_PATH + 3];
+
+		m_cchRawRoot = _tcslen(szRootPath);
+		m_cchRawSeparator = (m_cchRawRoot && (szRootPath[m_cchRawRoot - 1] == _T('\\') || szRootPath[m_cchRawRoot - 1] == _T('/')))? 0 : 1;
+
+		if (m_cchRawRoot > MAX_PATH || !PathCanonicalize (m_szRoot, szRootPath))
+			lstrcpyn (m_szRoot, szRootPath, ARRAYSIZE(m_szRoot));
+
+		// canonicalize a child path to learn how the root is written in front of its children
+		bool bHasPrefix = false;
+		if (m_cchRawRoot <= MAX_PATH - 2)
+		{
+			StringCchPrintf (szChild, ARRAYSIZE(szChild), _T("%s%sa"), szRootPath, m_cchRawSeparator? _T("\\") : _T(""));
+			if (PathCanonicalize (m_szPath, szChild))
+			{
+				m_cchPrefix = _tcslen (m_szPath) - 1;
+				bHasPrefix = (m_cchPrefix == 0) || (m_szPath[m_cchPrefix - 1] == _T('\\'));
+			}
+		}
+		if (!bHasPrefix)
+		{
+			StringCchPrintf (m_szPath, ARRAYSIZE(m_szPath), _T("%s%s"), szRootPath, m_cchRawSeparator? _T("\\") : _T(""));
+			m_cchPrefix = _tcslen (m_szPath);
+		}
+		m_szPath[m_cchPrefix] = 0;
+		m_cchPath = m_leafOffset = m_cchPrefix;
+	}
+
+	// returns the length to give to Pop in order to come back to the current entry
+	size_t Push(LPCTSTR szName)
+	{
+		size_t cchPrevious = m_cchPath;
+		size_t cchName = _tcslen (szName);
+		size_t cchSeparator = (m_cchPath > m_cchPrefix)? 1 : 0;
+
+		if (m_cchPath + cchSeparator + cchName < ARRAYSIZE(m_szPath))
+		{
+			if (cchSeparator)
+				m_szPath[m_cchPath++] = _T('\\');
+			m_leafOffset = m_cchPath;
+			memcpy (&m_szPath[m_cchPath], szName, (cchName + 1) * sizeof(TCHAR));
+			m_cchPath += cchName;
+		}
+		return cchPrevious;
+	}
+
+	void Pop(size_t cchPrevious)
+	{
+		m_cchPath = cchPrevious;
+		m_szPath[m_cchPath] = 0;
+	}
+
+	bool IsRoot() const { return m_cchPath == m_cchPrefix;}
+
+	// length of the path as built by the traversal, which is not canonicalized
+	size_t GetRawLength() const { return IsRoot()? m_cchRawRoot : m_cchRawRoot + m_cchRawSeparator + (m_cchPath - m_cchPrefix);}
+
+	LPCTSTR GetPath() const { return IsRoot()? m_szRoot : m_szPath;}
+	LPCTSTR GetLeaf() const { return IsRoot()? PathFindFileName (m_szRoot) : &m_szPath[m_leafOffset];}
+
+	// path below the input path, using '\\' separators
+	LPCTSTR GetRelativePath() const { return &m_szPath[m_cchPrefix];}
+};
+
+static CNamePath g_namePath;
+
+// Record the input path from which the names of all entries are derived
+void SetNameRoot(LPCTSTR szRootPath)
+{
+	TCHAR szFullPath[MAX_PATH + 1];
+	DWORD cchFullPath;
+	size_t cchRootPath = _tcslen(szRootPath);
+
+	g_namePath.SetRoot(szRootPath);
+
+	// a drive root has no name of its own (its trailing backslash was removed by the caller)
+	if (cchRootPath == 2 && szRootPath[1] == _T(':'))
+	{
+		g_szRootName.clear();
+		return;
+	}
+
+	cchFullPath = GetFullPathName(szRootPath, ARRAYSIZE(szFullPath), szFullPath, NULL);
+	if (cchFullPath && cchFullPath < ARRAYSIZE(szFullPath))
+		g_szRootName = PathFindFileName(szFullPath);
+	else
+		g_szRootName = PathFindFileName(szRootPath);
+
+	if (!g_szRootName.empty() && (g_szRootName[g_szRootName.length() - 1] == _T('\\')))
+		g_szRootName.clear();
+}
+
+bool IsExcludedName(LPCTSTR szName, list<wstring>& excludeSpecList)
+{
+	for (list<wstring>::iterator It = excludeSpecList.begin(); It != excludeSpecList.end(); It++)
+	{
+		if (PathMatchSpec (szName, It->c_str()))
+			return true;
+	}
+
+	return false;
+}
+
+void ShowError(LPCTSTR szMsg, ...)
+{
+	va_list args;
+	va_start( args, szMsg );
+	SetConsoleTextAttribute (g_hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
+	_vtprintf (szMsg, args );
+	SetConsoleTextAttribute (g_hConsole, g_wAttributes);
+	va_end( args );
+}
+
+// ---------------------------------------------
+// Lines for the result file are formatted in memory and written in large
+// blocks by a dedicated thread, so that slow storage does not stall hashing.
+// The blocks go through the same FILE* as before, hence the content of the
+// file is unchanged.
+
+#define OUTPUT_BLOCK_SIZE	(256 * 1024)
+#define OUTPUT_MAX_BLOCKS	16
+
+class COutputWriter
+{
+protected:
+	FILE* m_file;
+	HANDLE m_hThread;
+	HANDLE m_hDataEvent;
+	HANDLE m_hSpaceEvent;
+	CRITICAL_SECTION m_cs;
+	deque<wstring*> m_blocks;
+	wstring* m_pCurrent;
+	bool m_bStopping;
+	bool m_bWriteFailed;
+
+	static DWORD WINAPI WriterThread(LPVOID pParam)
+	{
+		COutputWriter* pWriter = (COutputWriter*) pParam;
+		for (;;)
+		{
+			wstring* pBlock = NULL;
+			bool bStopping;
+
+			EnterCriticalSection(&pWriter->m_cs);
+			if (!pWriter->m_blocks.empty())
+			{
+				pBlock = pWriter->m_blocks.front();
+				pWriter->m_blocks.pop_front();
+			}
+			bStopping = pWriter->m_bStopping;
+			LeaveCriticalSection(&pWriter->m_cs);
+
+			if (pBlock)
+			{
+				SetEvent(pWriter->m_hSpaceEvent);
+				if (_fputts(pBlock->c_str(), pWriter->m_file) < 0)
+					pWriter->m_bWriteFailed = true;
+				delete pBlock;
+			}
+			else if (bStopping)
+				break;
+			else
+				WaitForSingleObject(pWriter->m_hDataEvent, INFINITE);
+		}
+		return 0;
+	}
+
+	void QueueCurrent()
+	{
+		for (;;)
+		{
+			EnterCriticalSection(&m_cs);
+			if (m_blocks.size() < OUTPUT_MAX_BLOCKS)
+			{
+				m_blocks.push_back(m_pCurrent);
+				LeaveCriticalSection(&m_cs);
+				break;
+			}
+			LeaveCriticalSection(&m_cs);
+			WaitForSingleObject(m_hSpaceEvent, INFINITE);
+		}
+		SetEvent(m_hDataEvent);
+
+		m_pCurrent = new wstring();
+		m_pCurrent->reserve(OUTPUT_BLOCK_SIZE);
+	}
+
+public:
+	COutputWriter(FILE* f) : m_file(f), m_hThread(NULL), m_bStopping(false), m_bWriteFailed(false)
+	{
+		InitializeCriticalSection(&m_cs);
+		m_hDataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_hSpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_pCurrent = new wstring();
+		m_pCurrent->reserve(OUTPUT_BLOCK_SIZE);
+		if (m_hDataEvent && m_hSpaceEvent)
+			m_hThread = CreateThread(NULL, 0, WriterThread, this, 0, NULL);
+	}
+
+	~COutputWriter()
+	{
+		delete m_pCurrent;
+		if (m_hDataEvent) CloseHandle(m_hDataEvent);
+		if (m_hSpaceEvent) CloseHandle(m_hSpaceEvent);
+		DeleteCriticalSection(&m_cs);
+	}
+
+	bool IsRunning() const { return m_hThread != NULL;}
+
+	void Write(LPCTSTR szText)
+	{
+		m_pCurrent->append(szText);
+		if (m_pCurrent->length() >= OUTPUT_BLOCK_SIZE)
+			QueueCurrent();
+	}
+
+	// write what remains and wait for the thread to finish; returns false if any write failed
+	bool Stop()
+	{
+		if (!m_pCurrent->empty())
+			QueueCurrent();
+
+		EnterCriticalSection(&m_cs);
+		m_bStopping = true;
+		LeaveCriticalSection(&m_cs);
+		SetEvent(m_hDataEvent);
+
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+		return !m_bWriteFailed;
+	}
+};
+
+static COutputWriter* g_pOutputWriter = NULL;
+
+void OutputPrintf(LPCTSTR szFormat, ...)
+{
+	va_list args;
+	va_start(args, szFormat);
+	if (g_pOutputWriter)
+	{
+		// only called from the main thread
+		static TCHAR szLine[32768 + 600];
+		StringCchVPrintf(szLine, ARRAYSIZE(szLine), szFormat, args);
+		g_pOutputWriter->Write(szLine);
+	}
+	else
+		_vftprintf(outputFile, szFormat, args);
+	va_end(args);
+}
+
+void StartOutputWriter()
+{
+	g_pOutputWriter = new COutputWriter(outputFile);
+	if (!g_pOutputWriter->IsRunning())
+	{
+		delete g_pOutputWriter;
+		g_pOutputWriter = NULL;
+	}
+}
+
+void CloseOutput()
+{
+	if (g_pOutputWriter)
+	{
+		if (!g_pOutputWriter->Stop())
+			ShowError(_T("Error: Failed to write the result file\n"));
+		delete g_pOutputWriter;
+		g_pOutputWriter = NULL;
+	}
+	if (outputFile)
+	{
+		fclose(outputFile);
+		outputFile = NULL;
+	}
+}
+
+// ---------------------------------------------
+// -minsize, -maxsize, -newer and -older select files from the metadata
+// returned by the enumeration, so that filtered out files are never opened.
+// Times are compared in UTC with the last write time.
+
+static bool g_bFilterFiles = false;
+static bool g_bGitIgnore = false;
+static unsigned long long g_ullMinSize = 0;
+static unsigned long long g_ullMaxSize = (unsigned long long) -1;
+static unsigned long long g_ullNewerThan = 0;	// FILETIME, 0 when not set
+static unsigned long long g_ullOlderThan = 0;
+
+// Parse "YYYY-MM-DD" or "YYYY-MM-DDThh:mm:ss", optionally followed by fractional seconds and 'Z', as UTC
+bool ParseUtcTime(LPCTSTR szTime, unsigned long long& fileTime)
+{
+	SYSTEMTIME st;
+	FILETIME ft;
+	int year, month, day, hour = 0, minute = 0, second = 0, cchDate = 0, cchTime = 0;
+	LPCTSTR szEnd;
+
+	// the whole string must be consumed
+	if (_stscanf(szTime, _T("%4d-%2d-%2d%n"), &year, &month, &day, &cchDate) != 3)
+		return false;
+	szEnd = szTime + cchDate;
+	if (*szEnd == _T('T'))
+	{
+		if (_stscanf(szEnd, _T("T%2d:%2d:%2d%n"), &hour, &minute, &second, &cchTime) != 3)
+			return false;
+		szEnd += cchTime;
+		// object store listings add milliseconds and a Z
+		if (*szEnd == _T('.'))
+		{
+			for (szEnd++; _istdigit(*szEnd); szEnd++);
+		}
+		if (*szEnd == _T('Z'))
+			szEnd++;
+	}
+	if (*szEnd)
+		return false;
+
+	ZeroMemory(&st, sizeof(st));
+	st.wYear = (WORD) year;
+	st.wMonth = (WORD) month;
+	st.wDay = (WORD) day;
+	st.wHour = (WORD) hour;
+	st.wMinute = (WORD) minute;
+	st.wSecond = (WORD) second;
+	if (!SystemTimeToFileTime(&st, &ft))
+		return false;
+
+	fileTime = ((unsigned long long) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return true;
+}
+
+// Parse a number of bytes with an optional K, M, G or T (binary) suffix
+bool ParseSize(LPCTSTR szSize, unsigned long long& size)
+{
+	LPTSTR szEnd;
+	int shift = 0;
+	if (!_istdigit(szSize[0]))
+		return false;
+
+	errno = 0;
+	size = _tcstoui64(szSize, &szEnd, 10);
+	if (errno == ERANGE)
+		return false;
+	switch (_totupper(*szEnd))
+	{
+	case _T('T'): shift += 10;
+	case _T('G'): shift += 10;
+	case _T('M'): shift += 10;
+	case _T('K'): shift += 10; szEnd++; break;
+	}
+	if (*szEnd != 0 || size > (~0ULL >> shift))
+		return false;
+
+	size <<= shift;
+	return true;
+}
+
+void FormatUtcTime(unsigned long long fileTime, LPTSTR szTime, size_t cchTime)
+{
+	FILETIME ft;
+	SYSTEMTIME st;
+	ft.dwLowDateTime = (DWORD) fileTime;
+	ft.dwHighDateTime = (DWORD) (fileTime >> 32);
+	FileTimeToSystemTime(&ft, &st);
+	StringCchPrintf(szTime, cchTime, _T("%.4d-%.2d-%.2dT%.2d:%.2d:%.2dZ"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+}
+
+// Description of the active filters, recorded with the results
+wstring GetFilterDescription()
+{
+	wstring szDescription = g_bGitIgnore? _T("gitignore rules") : _T("");
+	TCHAR szItem[64];
+
+	if (g_ullMinSize)
+	{
+		StringCchPrintf(szItem, ARRAYSIZE(szItem), _T("%ssize >= %I64u"), szDescription.empty()? _T("") : _T(", "), g_ullMinSize);
+		szDescription += szItem;
+	}
+	if (g_ullMaxSize != (unsigned long long) -1)
+	{
+		StringCchPrintf(szItem, ARRAYSIZE(szItem), _T("%ssize <= %I64u"), szDescription.empty()? _T("") : _T(", "), g_ullMaxSize);
+		szDescription += szItem;
+	}
+	if (g_ullNewerThan)
+	{
+		szDescription += szDescription.empty()? _T("modified at or after ") : _T(", modified at or after ");
+		FormatUtcTime(g_ullNewerThan, szItem, ARRAYSIZE(szItem));
+		szDescription += szItem;
+	}
+	if (g_ullOlderThan)
+	{
+		szDescription += szDescription.empty()? _T("modified before ") : _T(", modified before ");
+		FormatUtcTime(g_ullOlderThan, szItem, ARRAYSIZE(szItem));
+		szDescription += szItem;
+	}
+	return szDescription;
+}
+
+BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+	if (dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_BREAK_EVENT || dwCtrlType == CTRL_CLOSE_EVENT)
+	{
+		// a second request falls back to the default handler, which ends the process
+		return (InterlockedIncrement(&g_lCancelRequests) == 1)? TRUE : FALSE;
+	}
+	return FALSE;
+}
+
+DWORD CheckCancellation()
+{
+	if (g_lCancelRequests)
+		return ERROR_CANCELLED;
+	if (g_dwTimeout && ((GetTickCount() - g_dwStartTicks) >= g_dwTimeout))
+		return ERROR_TIMEOUT;
+	return 0;
+}
+
+void ShowPartialReport(DWORD dwError, LPCTSTR szInterruptedPath)
+{
+	LPCTSTR szReason = (dwError == ERROR_TIMEOUT)? _T("Timeout reached") : _T("Operation cancelled");
+
+	LPCTSTR szPrefix = g_bSumReport? _T("# ") : _T("");
+
+	if (!g_bQuietReport)
+	{
+		_tprintf(_T("\n%s: no final hash was computed.\n%I64u file(s) (%I64u bytes) were completely processed.\n"), szReason, g_ullFilesDone, g_ullBytesDone);
+		if (!g_szLastFileDone.empty())
+			_tprintf(_T("Last completed file: \"%s\"\n"), g_szLastFileDone.c_str());
+		if (szInterruptedPath)
+			_tprintf(_T("Interrupted while processing: \"%s\"\n"), szInterruptedPath);
+	}
+
+	if (outputFile)
+	{
+		OutputPrintf(_T("%s%s: partial result, %I64u file(s) (%I64u bytes) completed\n"), szPrefix, szReason, g_ullFilesDone, g_ullBytesDone);
+		if (!g_szLastFileDone.empty())
+			OutputPrintf(_T("%sLast completed file: \"%s\"\n"), szPrefix, g_szLastFileDone.c_str());
+	}
+}
+
+bool IsTransientError(DWORD dwError)
+{
+	switch (dwError)
+	{
+	case ERROR_SHARING_VIOLATION:
+	case ERROR_LOCK_VIOLATION:
+	case ERROR_NETNAME_DELETED:
+	case ERROR_UNEXP_NET_ERR:
+	case ERROR_SEM_TIMEOUT:
+	case ERROR_BAD_NETPATH:
+	case ERROR_WINHTTP_TIMEOUT:
+	case ERROR_WINHTTP_CONNECTION_ERROR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Wait before a new attempt of a failed operation. Returns false if the
+// operation must not be retried.
+bool WaitBeforeRetry(DWORD dwError, int iAttempt)
+{
+	if (iAttempt >= g_iMaxRetries || !IsTransientError(dwError) || CheckCancellation())
+		return false;
+
+	Sleep(min(250UL << iAttempt, 8000UL));
+	return CheckCancellation() == 0;
+}
+
+// Record a failure in the given phase ("open", "read" or "list"). Returns the
+// error to propagate, which is 0 when the run must continue.
+DWORD RecordError(LPCTSTR szPhase, LPCTSTR szPath, DWORD dwError)
+{
+	if (!g_bContinueOnError)
+		return dwError;
+
+	g_ullErrorCount++;
+	if (g_errorFile)
+		_ftprintf(g_errorFile, _T("%s\t0x%.8X\t%s\n"), szPhase, dwError, szPath);
+	return 0;
+}
+
+HANDLE OpenFileDirect(LPCTSTR szFilePath, DWORD& dwError)
+{
+	HANDLE hFile = CreateFile(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		dwError = GetLastError();
+	return hFile;
+}
+
+DWORD ReadFileDirect(HANDLE hFile, unsigned long long offset, LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+{
+	DWORD cbRead = 0;
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(ov));
+	ov.Offset = (DWORD) offset;
+	ov.OffsetHigh = (DWORD) (offset >> 32);
+
+	if (ReadFile(hFile, pbBuffer, cbBuffer, &cbRead, &ov))
+		return cbRead;
+
+	dwError = GetLastError();
+	if (dwError == ERROR_HANDLE_EOF)
+		dwError = 0;
+	return 0;
+}
+
+// ---------------------------------------------
+// With -iotimeout, opens and reads are executed by a worker thread while the
+// main thread waits for them with a deadline. On unresponsive network shares
+// an operation can block for minutes: it is then cancelled with
+// CancelSynchronousIo when available, and otherwise the worker is abandoned
+// (it deletes itself if the operation ever returns) and a new one is created
+// for the next operations. The stuck entry fails with ERROR_SEM_TIMEOUT, so it
+// can be retried (-retry) or recorded and skipped (-continue).
+
+typedef BOOL (WINAPI *CancelSynchronousIoFn)(HANDLE hThread);
+static CancelSynchronousIoFn g_pfnCancelSynchronousIo = NULL;
+
+class CIoWorker
+{
+protected:
+	enum { OP_OPEN, OP_READ, OP_EXIT };
+	enum { STATE_BUSY, STATE_DONE, STATE_ABANDONED };
+
+	HANDLE m_hThread;
+	HANDLE m_hRequestEvent;
+	HANDLE m_hDoneEvent;
+	volatile LONG m_lState;
+	int m_iOperation;
+	wstring m_szPath;
+	HANDLE m_hFile;
+	unsigned long long m_offset;
+	DWORD m_cbRequested;
+	DWORD m_cbRead;
+	DWORD m_dwError;
+	BYTE m_pbBuffer[65536];
+
+	CIoWorker() : m_hThread(NULL), m_lState(STATE_DONE), m_iOperation(OP_EXIT), m_hFile(INVALID_HANDLE_VALUE), m_offset(0), m_cbRequested(0), m_cbRead(0), m_dwError(0)
+	{
+		m_hRequestEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_hDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	~CIoWorker()
+	{
+		if (m_hThread) CloseHandle(m_hThread);
+		if (m_hRequestEvent) CloseHandle(m_hRequestEvent);
+		if (m_hDoneEvent) CloseHandle(m_hDoneEvent);
+	}
+
+	static DWORD WINAPI ThreadProc(LPVOID pParam)
+	{
+		CIoWorker* pWorker = (CIoWorker*) pParam;
+		for (;;)
+		{
+			WaitForSingleObject(pWorker->m_hRequestEvent, INFINITE);
+			if (pWorker->m_iOperation == OP_EXIT)
+				break;
+
+			pWorker->m_dwError = 0;
+			if (pWorker->m_iOperation == OP_OPEN)
+				pWorker->m_hFile = OpenFileDirect(pWorker->m_szPath.c_str(), pWorker->m_dwError);
+			else
+				pWorker->m_cbRead = ReadFileDirect(pWorker->m_hFile, pWorker->m_offset, pWorker->m_pbBuffer, pWorker->m_cbRequested, pWorker->m_dwError);
+
+			if (InterlockedCompareExchange(&pWorker->m_lState, STATE_DONE, STATE_BUSY) == STATE_ABANDONED)
+			{
+				// nobody waits for this operation anymore: release the file it was about
+				if (pWorker->m_hFile != INVALID_HANDLE_VALUE)
+					CloseHandle(pWorker->m_hFile);
+				break;
+			}
+			SetEvent(pWorker->m_hDoneEvent);
+		}
+
+		if (pWorker->m_lState == STATE_ABANDONED)
+			delete pWorker;
+		return 0;
+	}
+
+	// Returns false if the operation was abandoned: this object must not be used anymore
+	bool Execute()
+	{
+		m_lState = STATE_BUSY;
+		SetEvent(m_hRequestEvent);
+		if (WaitForSingleObject(m_hDoneEvent, g_dwIoTimeout) == WAIT_OBJECT_0)
+			return true;
+
+		if (g_pfnCancelSynchronousIo && g_pfnCancelSynchronousIo(m_hThread)
+			&& (WaitForSingleObject(m_hDoneEvent, 1000) == WAIT_OBJECT_0))
+		{
+			if (m_dwError == ERROR_OPERATION_ABORTED)
+				m_dwError = ERROR_SEM_TIMEOUT;
+			return true;
+		}
+
+		if (InterlockedCompareExchange(&m_lState, STATE_ABANDONED, STATE_BUSY) == STATE_DONE)
+		{
+			// completed just before being abandoned
+			WaitForSingleObject(m_hDoneEvent, INFINITE);
+			return true;
+		}
+		return false;
+	}
+
+public:
+	static CIoWorker* Create()
+	{
+		CIoWorker* pWorker = new CIoWorker();
+		if (pWorker->m_hRequestEvent && pWorker->m_hDoneEvent)
+			pWorker->m_hThread = CreateThread(NULL, 0, ThreadProc, pWorker, 0, NULL);
+		if (!pWorker->m_hThread)
+		{
+			delete pWorker;
+			return NULL;
+		}
+		return pWorker;
+	}
+
+	void Stop()
+	{
+		m_iOperation = OP_EXIT;
+		SetEvent(m_hRequestEvent);
+		WaitForSingleObject(m_hThread, INFINITE);
+		delete this;
+	}
+
+	// On timeout, false is returned and the worker has been abandoned
+	bool Open(LPCTSTR szFilePath, HANDLE& hFile, DWORD& dwError)
+	{
+		m_iOperation = OP_OPEN;
+		m_szPath = szFilePath;
+		m_hFile = INVALID_HANDLE_VALUE;
+		if (!Execute())
+			return false;
+		hFile = m_hFile;
+		m_hFile = INVALID_HANDLE_VALUE;
+		if (hFile == INVALID_HANDLE_VALUE)
+			dwError = m_dwError;
+		return true;
+	}
+
+	// On timeout, false is returned and the worker has taken ownership of hFile
+	bool Read(HANDLE hFile, unsigned long long offset, LPBYTE pbBuffer, DWORD cbBuffer, DWORD& cbRead, DWORD& dwError)
+	{
+		m_iOperation = OP_READ;
+		m_hFile = hFile;
+		m_offset = offset;
+		m_cbRequested = min(cbBuffer, (DWORD) sizeof(m_pbBuffer));
+		if (!Execute())
+			return false;
+		m_hFile = INVALID_HANDLE_VALUE;
+		cbRead = m_cbRead;
+		if (cbRead)
+			memcpy(pbBuffer, m_pbBuffer, cbRead);
+		else
+			dwError = m_dwError;
+		return true;
+	}
+};
+
+static CIoWorker* g_pIoWorker = NULL;
+
+bool InitIoWorker()
+{
+	if (!g_pfnCancelSynchronousIo)
+		g_pfnCancelSynchronousIo = (CancelSynchronousIoFn) GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "CancelSynchronousIo");
+	if (!g_pIoWorker)
+		g_pIoWorker = CIoWorker::Create();
+	return g_pIoWorker != NULL;
+}
+
+void ReportStuckOperation(LPCTSTR szOperation, LPCTSTR szFilePath)
+{
+	_tprintf(TEXT("%s of \"%s\" did not complete within %u seconds and was abandoned\n"), szOperation, szFilePath, g_dwIoTimeout / 1000);
+}
+
+HANDLE OpenLocalFile(LPCTSTR szFilePath, DWORD& dwError)
+{
+	HANDLE hFile;
+	for (int iAttempt = 0; ; iAttempt++)
+	{
+		if (!g_dwIoTimeout)
+			hFile = OpenFileDirect(szFilePath, dwError);
+		else if (!InitIoWorker())
+		{
+			hFile = INVALID_HANDLE_VALUE;
+			dwError = ERROR_NOT_ENOUGH_MEMORY;
+		}
+		else if (!g_pIoWorker->Open(szFilePath, hFile, dwError))
+		{
+			g_pIoWorker = NULL;
+			ReportStuckOperation(_T("Opening"), szFilePath);
+			hFile = INVALID_HANDLE_VALUE;
+			dwError = ERROR_SEM_TIMEOUT;
+		}
+
+		if (hFile != INVALID_HANDLE_VALUE)
+			return hFile;
+
+		if (!WaitBeforeRetry(dwError, iAttempt))
+			return INVALID_HANDLE_VALUE;
+	}
+}
+
+// Read a block at the given offset, so that a failed read can be retried at
+// the same position. A return value of 0 with no error means end of file.
+// If the read is abandoned by the -iotimeout watchdog, hFile is set to
+// INVALID_HANDLE_VALUE since it now belongs to the stuck worker.
+DWORD ReadFileBlock(LPCTSTR szFilePath, HANDLE& hFile, unsigned long long offset, LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+{
+	DWORD cbRead;
+	for (int iAttempt = 0; ; iAttempt++)
+	{
+		cbRead = 0;
+		dwError = 0;
+		if (!g_dwIoTimeout)
+			cbRead = ReadFileDirect(hFile, offset, pbBuffer, cbBuffer, dwError);
+		else if (!InitIoWorker())
+			dwError = ERROR_NOT_ENOUGH_MEMORY;
+		else if (!g_pIoWorker->Read(hFile, offset, pbBuffer, cbBuffer, cbRead, dwError))
+		{
+			g_pIoWorker = NULL;
+			ReportStuckOperation(_T("Reading"), szFilePath);
+			hFile = INVALID_HANDLE_VALUE;
+			dwError = ERROR_SEM_TIMEOUT;
+			return 0;
+		}
+
+		if (cbRead || !dwError)
+			return cbRead;
+
+		if (!WaitBeforeRetry(dwError, iAttempt))
+			return 0;
+	}
+}
+
+// ---------------------------------------------
+
+// Source of the content of a file being hashed, read sequentially
+class CFileReader
+{
+public:
+	virtual ~CFileReader() {}
+	// returns 0 at the end of the file or on error, in which case dwError is set
+	virtual DWORD Read(LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError) = 0;
+	virtual unsigned long long GetSize() = 0;
+};
+
+class CLocalFileReader : public CFileReader
+{
+protected:
+	LPCTSTR m_szFilePath;
+	HANDLE m_hFile;
+	unsigned long long m_offset;
+public:
+	CLocalFileReader(LPCTSTR szFilePath, HANDLE hFile) : m_szFilePath(szFilePath), m_hFile(hFile), m_offset(0) {}
+	~CLocalFileReader()
+	{
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+	}
+
+	DWORD Read(LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+	{
+		DWORD cbRead = ReadFileBlock(m_szFilePath, m_hFile, m_offset, pbBuffer, cbBuffer, dwError);
+		m_offset += cbRead;
+		return cbRead;
+	}
+
+	unsigned long long GetSize()
+	{
+		LARGE_INTEGER liFileSize;
+		return GetFileSizeEx(m_hFile, &liFileSize)? (unsigned long long) liFileSize.QuadPart : 0;
+	}
+};
+
+// ---------------------------------------------
+// Input from an S3-compatible object store, given as
+// http(s)://host[:port]/bucket[/prefix]. Objects below the prefix are listed
+// with ListObjectsV2 using path-style requests, signed with AWS Signature
+// Version 4 when credentials are found in the environment and anonymous
+// otherwise, and presented as a virtual tree whose root is the last component
+// of the prefix. A tree therefore has the same digest as its downloaded copy
+// hashed from its parent directory. Each object is read with up to
+// g_iHttpConnections parallel ranged GETs, consumed in order and served by a
+// fixed set of g_iHttpConnections fetch threads shared by all readers.
+
+#define OBJECT_CHUNK_SIZE (8 * 1024 * 1024)
+static int g_iHttpConnections = 4;
+
+string ToUtf8(const wstring& str)
+{
+	string result;
+	int cbUtf8 = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int) str.length(), NULL, 0, NULL, NULL);
+	if (cbUtf8 > 0)
+	{
+		result.resize(cbUtf8);
+		WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int) str.length(), &result[0], cbUtf8, NULL, NULL);
+	}
+	return result;
+}
+
+wstring FromUtf8(const string& str)
+{
+	wstring result;
+	int cchWide = MultiByteToWideChar(CP_UTF8, 0, str.c_str(), (int) str.length(), NULL, 0);
+	if (cchWide > 0)
+	{
+		result.resize(cchWide);
+		MultiByteToWideChar(CP_UTF8, 0, str.c_str(), (int) str.length(), &result[0], cchWide);
+	}
+	return result;
+}
+
+wstring UrlEncode(const wstring& str, bool bKeepSlashes)
+{
+	static const char hexDigits[] = "0123456789ABCDEF";
+	string utf8 = ToUtf8(str);
+	wstring result;
+	for (size_t i = 0; i < utf8.length(); i++)
+	{
+		unsigned char c = (unsigned char) utf8[i];
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+			|| c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && bKeepSlashes))
+			result += (WCHAR) c;
+		else
+		{
+			result += L'%';
+			result += (WCHAR) hexDigits[c >> 4];
+			result += (WCHAR) hexDigits[c & 0x0F];
+		}
+	}
+	return result;
+}
+
+// Return the unescaped text of the next <szTag> element found after pos
+bool NextXmlElement(const string& xml, const char* szTag, size_t& pos, string& value)
+{
+	string openTag = string("<") + szTag + ">", closeTag = string("</") + szTag + ">";
+	size_t start = xml.find(openTag, pos), end;
+	if (start == string::npos)
+		return false;
+	start += openTag.length();
+	end = xml.find(closeTag, start);
+	if (end == string::npos)
+		return false;
+	pos = end + closeTag.length();
+
+	value.clear();
+	for (size_t i = start; i < end; i++)
+	{
+		if (xml[i] == '&')
+		{
+			size_t semicolon = xml.find(';', i);
+			string entity = (semicolon != string::npos && semicolon < end)? xml.substr(i + 1, semicolon - i - 1) : "";
+			unsigned long codePoint = 0;
+			if (entity == "amp") codePoint = '&';
+			else if (entity == "lt") codePoint = '<';
+			else if (entity == "gt") codePoint = '>';
+			else if (entity == "quot") codePoint = '"';
+			else if (entity == "apos") codePoint = '\'';
+			else if (entity.length() > 1 && entity[0] == '#')
+				codePoint = (entity[1] == 'x')? strtoul(entity.c_str() + 2, NULL, 16) : strtoul(entity.c_str() + 1, NULL, 10);
+
+			// numeric references may designate any character, stored here as UTF-8
+			if (codePoint && codePoint <= 0x10FFFF && (codePoint < 0xD800 || codePoint > 0xDFFF))
+			{
+				if (codePoint < 0x80)
+					value += (char) codePoint;
+				else if (codePoint < 0x800)
+				{
+					value += (char) (0xC0 | (codePoint >> 6));
+					value += (char) (0x80 | (codePoint & 0x3F));
+				}
+				else if (codePoint < 0x10000)
+				{
+					value += (char) (0xE0 | (codePoint >> 12));
+					value += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+					value += (char) (0x80 | (codePoint & 0x3F));
+				}
+				else
+				{
+					value += (char) (0xF0 | (codePoint >> 18));
+					value += (char) (0x80 | ((codePoint >> 12) & 0x3F));
+					value += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+					value += (char) (0x80 | (codePoint & 0x3F));
+				}
+				i = semicolon;
+				continue;
+			}
+		}
+		value += xml[i];
+	}
+	return true;
+}
+
+string HexLower(const unsigned char* pbData, size_t cbData)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+	string result;
+	for (size_t i = 0; i < cbData; i++)
+	{
+		result += hexDigits[pbData[i] >> 4];
+		result += hexDigits[pbData[i] & 0x0F];
+	}
+	return result;
+}
+
+string Sha256Hex(const string& data)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256((const unsigned char*) data.data(), data.length(), digest);
+	return HexLower(digest, sizeof(digest));
+}
+
+string HmacSha256(const string& key, const string& data)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int cbDigest = 0;
+	HMAC(EVP_sha256(), key.data(), (int) key.length(), (const unsigned char*) data.data(), data.length(), digest, &cbDigest);
+	return string((const char*) digest, cbDigest);
+}
+
+string GetEnvironmentUtf8(LPCWSTR szName)
+{
+	WCHAR szValue[2048];
+	DWORD cch = GetEnvironmentVariable(szName, szValue, ARRAYSIZE(szValue));
+	return (cch && cch < ARRAYSIZE(szValue))? ToUtf8(szValue) : "";
+}
+
+DWORD HttpStatusToError(DWORD dwStatus)
+{
+	switch (dwStatus)
+	{
+	case 401:
+	case 403: return ERROR_ACCESS_DENIED;
+	case 404: return ERROR_FILE_NOT_FOUND;
+	case 416: return ERROR_HANDLE_EOF;
+	default:  return (dwStatus >= 500)? ERROR_UNEXP_NET_ERR : ERROR_INVALID_DATA;
+	}
+}
+
+struct CObjectEntry
+{
+	bool bIsDir;
+	unsigned long long size;
+	unsigned long long lastWriteTime;
+};
+
+// ranged GET of an object, queued to the fetch threads of the store
+struct CObjectChunk
+{
+	wstring szObjectPath;
+	unsigned long long start;
+	DWORD cbLength;
+	string data;
+	DWORD dwError;
+	volatile LONG lCancelled;
+	HANDLE hDone;			// NULL when the chunk was fetched synchronously
+};
+
+class CObjectStore
+{
+protected:
+	HINTERNET m_hSession;
+	HINTERNET m_hConnect;
+	bool m_bSecure;
+	string m_szHostHeader;
+	string m_szAccessKey;
+	string m_szSecretKey;
+	string m_szSessionToken;
+	string m_szRegion;
+	wstring m_szBucket;
+	wstring m_szPrefix;		// key prefix of the root, ending with '/' unless empty
+	wstring m_szRootName;
+	bool m_bRootIsObject;
+	unsigned long long m_rootSize;
+	map<wstring, map<wstring, CObjectEntry> > m_dirs;	// virtual directory path -> entries
+	CRITICAL_SECTION m_csFetch;
+	deque<CObjectChunk*> m_fetchQueue;
+	HANDLE m_hFetchSemaphore;
+	vector<HANDLE> m_fetchThreads;
+
+	CObjectStore() : m_hSession(NULL), m_hConnect(NULL), m_bSecure(false), m_bRootIsObject(false), m_rootSize(0), m_hFetchSemaphore(NULL)
+	{
+		InitializeCriticalSection(&m_csFetch);
+	}
+
+	static DWORD WINAPI FetchThread(LPVOID pParam)
+	{
+		CObjectStore* pStore = (CObjectStore*) pParam;
+		for (;;)
+		{
+			CObjectChunk* pChunk = NULL;
+			WaitForSingleObject(pStore->m_hFetchSemaphore, INFINITE);
+			EnterCriticalSection(&pStore->m_csFetch);
+			if (!pStore->m_fetchQueue.empty())
+			{
+				pChunk = pStore->m_fetchQueue.front();
+				pStore->m_fetchQueue.pop_front();
+			}
+			LeaveCriticalSection(&pStore->m_csFetch);
+
+			// the destructor wakes the threads up with an empty queue
+			if (!pChunk)
+				break;
+			pStore->Fetch(pChunk);
+			SetEvent(pChunk->hDone);
+		}
+		return 0;
+	}
+
+	void StartFetchThreads()
+	{
+		m_hFetchSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+		for (int i = 0; m_hFetchSemaphore && i < g_iHttpConnections; i++)
+		{
+			HANDLE hThread = CreateThread(NULL, 0, FetchThread, this, 0, NULL);
+			if (!hThread)
+				break;
+			m_fetchThreads.push_back(hThread);
+		}
+	}
+
+	void Fetch(CObjectChunk* pChunk)
+	{
+		for (int iAttempt = 0; ; iAttempt++)
+		{
+			if (pChunk->lCancelled)
+			{
+				pChunk->dwError = ERROR_CANCELLED;
+				break;
+			}
+			pChunk->dwError = HttpGet(pChunk->szObjectPath, pChunk->start, pChunk->cbLength, pChunk->data);
+			if (!pChunk->dwError || !WaitBeforeRetry(pChunk->dwError, iAttempt))
+				break;
+		}
+	}
+
+	// AWS Signature Version 4 headers of a GET request. The path and the query
+	// values are already URI-encoded the way the canonical request expects.
+	wstring GetSignatureHeaders(const wstring& szPathAndQuery)
+	{
+		static const char szEmptyPayloadHash[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+		SYSTEMTIME st;
+		char szDateTime[32];
+		string pathAndQuery = ToUtf8(szPathAndQuery), path, query, headers, signedHeaders;
+		vector<pair<string, string> > params;
+		size_t question = pathAndQuery.find('?');
+
+		GetSystemTime(&st);
+		StringCchPrintfA(szDateTime, ARRAYSIZE(szDateTime), "%04d%02d%02dT%02d%02d%02dZ", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+		string date(szDateTime, 8);
+		string scope = date + "/" + m_szRegion + "/s3/aws4_request";
+
+		// canonical query: parameters sorted by name, each with a value
+		path = pathAndQuery.substr(0, question);
+		if (question != string::npos)
+		{
+			size_t start = question + 1, end;
+			do
+			{
+				end = pathAndQuery.find('&', start);
+				string param = pathAndQuery.substr(start, (end == string::npos)? string::npos : end - start);
+				size_t equal = param.find('=');
+				params.push_back(make_pair(param.substr(0, equal), (equal == string::npos)? string() : param.substr(equal + 1)));
+				start = end + 1;
+			}
+			while (end != string::npos);
+			sort(params.begin(), params.end());
+		}
+		for (size_t i = 0; i < params.size(); i++)
+			query += (i? "&" : "") + params[i].first + "=" + params[i].second;
+
+		headers = "host:" + m_szHostHeader + "\nx-amz-content-sha256:" + szEmptyPayloadHash + "\nx-amz-date:" + szDateTime + "\n";
+		signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+		if (!m_szSessionToken.empty())
+		{
+			headers += "x-amz-security-token:" + m_szSessionToken + "\n";
+			signedHeaders += ";x-amz-security-token";
+		}
+
+		string canonicalRequest = "GET\n" + path + "\n" + query + "\n" + headers + "\n" + signedHeaders + "\n" + szEmptyPayloadHash;
+		string stringToSign = string("AWS4-HMAC-SHA256\n") + szDateTime + "\n" + scope + "\n" + Sha256Hex(canonicalRequest);
+		string signingKey = HmacSha256(HmacSha256(HmacSha256(HmacSha256("AWS4" + m_szSecretKey, date), m_szRegion), "s3"), "aws4_request");
+		string signature = HmacSha256(signingKey, stringToSign);
+
+		string result = string("x-amz-content-sha256: ") + szEmptyPayloadHash + "\r\nx-amz-date: " + szDateTime + "\r\n";
+		if (!m_szSessionToken.empty())
+			result += "x-amz-security-token: " + m_szSessionToken + "\r\n";
+		result += "Authorization: AWS4-HMAC-SHA256 Credential=" + m_szAccessKey + "/" + scope
+			+ ", SignedHeaders=" + signedHeaders + ", Signature=" + HexLower((const unsigned char*) signature.data(), signature.length());
+		return FromUtf8(result);
+	}
+
+	wstring GetListQuery(const wstring& szPrefix, const wstring& szToken, int iMaxKeys)
+	{
+		wstring szQuery = L"/" + UrlEncode(m_szBucket, false) + L"?list-type=2&prefix=" + UrlEncode(szPrefix, false);
+		if (!szToken.empty())
+			szQuery += L"&continuation-token=" + UrlEncode(szToken, false);
+		if (iMaxKeys)
+		{
+			WCHAR szMaxKeys[32];
+			StringCchPrintf(szMaxKeys, ARRAYSIZE(szMaxKeys), L"&max-keys=%d", iMaxKeys);
+			szQuery += szMaxKeys;
+		}
+		return szQuery;
+	}
+
+	void AddObject(const wstring& szRelativeKey, unsigned long long size, unsigned long long lastWriteTime)
+	{
+		wstring szDir = m_szRootName;
+		size_t start = 0, slash;
+
+		while ((slash = szRelativeKey.find(L'/', start)) != wstring::npos)
+		{
+			wstring szName = szRelativeKey.substr(start, slash - start);
+			start = slash + 1;
+			if (szName.empty())
+				continue;
+
+			CObjectEntry dirEntry = { true, 0, 0 };
+			m_dirs[szDir][szName] = dirEntry;
+			szDir += L"\\" + szName;
+			m_dirs[szDir];
+		}
+
+		// keys ending with '/' are folder markers
+		if (start < szRelativeKey.length())
+		{
+			CObjectEntry fileEntry = { false, size, lastWriteTime };
+			map<wstring, CObjectEntry>& entries = m_dirs[szDir];
+			if (entries.find(szRelativeKey.substr(start)) == entries.end())
+				entries[szRelativeKey.substr(start)] = fileEntry;
+		}
+	}
+
+	DWORD List()
+	{
+		wstring szToken;
+		string response, key, size, lastModified, truncated, token;
+		DWORD dwError;
+
+		// without a trailing slash, the URL may designate a single object
+		if (!m_szPrefix.empty() && m_szPrefix[m_szPrefix.length() - 1] != L'/')
+		{
+			size_t pos = 0;
+			if ((dwError = HttpGet(GetListQuery(m_szPrefix, L"", 1), 0, 0, response)) != 0)
+				return dwError;
+			if (NextXmlElement(response, "Key", pos, key) && FromUtf8(key) == m_szPrefix
+				&& NextXmlElement(response, "Size", pos, size))
+			{
+				m_bRootIsObject = true;
+				m_rootSize = _strtoui64(size.c_str(), NULL, 10);
+				return 0;
+			}
+			m_szPrefix += L'/';
+		}
+
+		m_dirs[m_szRootName];
+		do
+		{
+			size_t pos = 0, contentsPos = 0;
+			string contents;
+			if ((dwError = HttpGet(GetListQuery(m_szPrefix, szToken, 0), 0, 0, response)) != 0)
+				return dwError;
+
+			while (NextXmlElement(response, "Contents", contentsPos, contents))
+			{
+				size_t entryPos = 0, sizePos = 0, timePos = 0;
+				if (NextXmlElement(contents, "Key", entryPos, key) && NextXmlElement(contents, "Size", sizePos, size))
+				{
+					wstring szKey = FromUtf8(key);
+					unsigned long long lastWriteTime = 0;
+					if (NextXmlElement(contents, "LastModified", timePos, lastModified))
+						ParseUtcTime(FromUtf8(lastModified).c_str(), lastWriteTime);
+					if (szKey.length() > m_szPrefix.length())
+						AddObject(szKey.substr(m_szPrefix.length()), _strtoui64(size.c_str(), NULL, 10), lastWriteTime);
+				}
+			}
+
+			szToken.clear();
+			if (NextXmlElement(response, "IsTruncated", pos, truncated) && truncated == "true")
+			{
+				pos = 0;
+				if (!NextXmlElement(response, "NextContinuationToken", pos, token))
+					return ERROR_INVALID_DATA;
+				szToken = FromUtf8(token);
+			}
+		}
+		while (!szToken.empty());
+
+		return 0;
+	}
+
+	// path of the object corresponding to a virtual path, as used in requests
+	wstring GetObjectPath(LPCTSTR szPath)
+	{
+		wstring szKey = m_szPrefix;
+		if (!m_bRootIsObject)
+		{
+			LPCTSTR szRelative = szPath + min(m_szRootName.length() + 1, _tcslen(szPath));
+			for (; *szRelative; szRelative++)
+				szKey += (*szRelative == L'\\')? L'/' : *szRelative;
+		}
+		return L"/" + UrlEncode(m_szBucket, false) + L"/" + UrlEncode(szKey, true);
+	}
+
+public:
+	~CObjectStore()
+	{
+		if (!m_fetchThreads.empty())
+		{
+			ReleaseSemaphore(m_hFetchSemaphore, (LONG) m_fetchThreads.size(), NULL);
+			for (size_t i = 0; i < m_fetchThreads.size(); i++)
+			{
+				WaitForSingleObject(m_fetchThreads[i], INFINITE);
+				CloseHandle(m_fetchThreads[i]);
+			}
+		}
+		if (m_hFetchSemaphore) CloseHandle(m_hFetchSemaphore);
+		DeleteCriticalSection(&m_csFetch);
+		if (m_hConnect) WinHttpCloseHandle(m_hConnect);
+		if (m_hSession) WinHttpCloseHandle(m_hSession);
+	}
+
+	static bool IsObjectStoreUrl(LPCTSTR szInput)
+	{
+		return (_tcsnicmp(szInput, _T("http://"), 7) == 0) || (_tcsnicmp(szInput, _T("https://"), 8) == 0);
+	}
+
+	static CObjectStore* Open(LPCTSTR szUrl, DWORD& dwError)
+	{
+		URL_COMPONENTS urlComp;
+		CObjectStore* pStore = new CObjectStore();
+		wstring szHost, szPath;
+
+		ZeroMemory(&urlComp, sizeof(urlComp));
+		urlComp.dwStructSize = sizeof(urlComp);
+		urlComp.dwHostNameLength = (DWORD) -1;
+		urlComp.dwUrlPathLength = (DWORD) -1;
+		if (!WinHttpCrackUrl(szUrl, 0, 0, &urlComp))
+		{
+			dwError = GetLastError();
+			delete pStore;
+			return NULL;
+		}
+
+		szHost.assign(urlComp.lpszHostName, urlComp.dwHostNameLength);
+		szPath.assign(urlComp.lpszUrlPath, urlComp.dwUrlPathLength);
+		pStore->m_bSecure = (urlComp.nScheme == INTERNET_SCHEME_HTTPS);
+
+		// the Host header as sent by WinHTTP, which signed requests must match
+		pStore->m_szHostHeader = ToUtf8(szHost);
+		if (urlComp.nPort != (pStore->m_bSecure? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT))
+		{
+			char szPort[16];
+			StringCchPrintfA(szPort, ARRAYSIZE(szPort), ":%u", (unsigned int) urlComp.nPort);
+			pStore->m_szHostHeader += szPort;
+		}
+
+		// credentials are taken from the usual AWS environment variables
+		pStore->m_szAccessKey = GetEnvironmentUtf8(L"AWS_ACCESS_KEY_ID");
+		pStore->m_szSecretKey = GetEnvironmentUtf8(L"AWS_SECRET_ACCESS_KEY");
+		pStore->m_szSessionToken = GetEnvironmentUtf8(L"AWS_SESSION_TOKEN");
+		pStore->m_szRegion = GetEnvironmentUtf8(L"AWS_REGION");
+		if (pStore->m_szRegion.empty())
+			pStore->m_szRegion = GetEnvironmentUtf8(L"AWS_DEFAULT_REGION");
+		if (pStore->m_szRegion.empty())
+			pStore->m_szRegion = "us-east-1";
+		if (pStore->m_szAccessKey.empty() || pStore->m_szSecretKey.empty())
+			pStore->m_szAccessKey.clear();
+
+		// path is /bucket[/prefix]
+		size_t slash = szPath.find(L'/', 1);
+		pStore->m_szBucket = szPath.substr(1, (slash == wstring::npos)? wstring::npos : slash - 1);
+		pStore->m_szPrefix = (slash == wstring::npos)? L"" : szPath.substr(slash + 1);
+		if (pStore->m_szBucket.empty())
+		{
+			dwError = ERROR_INVALID_PARAMETER;
+			delete pStore;
+			return NULL;
+		}
+
+		wstring szRoot = pStore->m_szPrefix;
+		while (!szRoot.empty() && szRoot[szRoot.length() - 1] == L'/')
+			szRoot.erase(szRoot.length() - 1);
+		pStore->m_szRootName = szRoot.empty()? pStore->m_szBucket : szRoot.substr(szRoot.rfind(L'/') + 1);
+
+		pStore->m_hSession = WinHttpOpen(L"DirHash", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+		if (pStore->m_hSession)
+		{
+			if (g_dwIoTimeout)
+				WinHttpSetTimeouts(pStore->m_hSession, (int) g_dwIoTimeout, (int) g_dwIoTimeout, (int) g_dwIoTimeout, (int) g_dwIoTimeout);
+			pStore->m_hConnect = WinHttpConnect(pStore->m_hSession, szHost.c_str(), urlComp.nPort, 0);
+		}
+		if (!pStore->m_hConnect)
+		{
+			dwError = GetLastError();
+			delete pStore;
+			return NULL;
+		}
+
+		if ((dwError = pStore->List()) != 0)
+		{
+			delete pStore;
+			return NULL;
+		}
+		pStore->StartFetchThreads();
+		return pStore;
+	}
+
+	// GET a whole resource, or cbLength bytes of it starting at start when cbLength is not 0
+	DWORD HttpGet(const wstring& szPathAndQuery, unsigned long long start, DWORD cbLength, string& response)
+	{
+		DWORD dwError = 0, dwStatus = 0, cbStatus = sizeof(dwStatus);
+		HINTERNET hRequest = WinHttpOpenRequest(m_hConnect, L"GET", szPathAndQuery.c_str(), NULL, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES, m_bSecure? WINHTTP_FLAG_SECURE : 0);
+		if (!hRequest)
+			return GetLastError();
+
+		response.clear();
+		if (cbLength)
+		{
+			WCHAR szRange[80];
+			StringCchPrintf(szRange, ARRAYSIZE(szRange), L"Range: bytes=%I64u-%I64u", start, start + cbLength - 1);
+			WinHttpAddRequestHeaders(hRequest, szRange, (DWORD) -1, WINHTTP_ADDREQ_FLAG_ADD);
+			response.reserve(cbLength);
+		}
+		if (!m_szAccessKey.empty())
+			WinHttpAddRequestHeaders(hRequest, GetSignatureHeaders(szPathAndQuery).c_str(), (DWORD) -1, WINHTTP_ADDREQ_FLAG_ADD);
+
+		if (!WinHttpSendRequest(hRequest, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0)
+			|| !WinHttpReceiveResponse(hRequest, NULL)
+			|| !WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &dwStatus, &cbStatus, WINHTTP_NO_HEADER_INDEX))
+			dwError = GetLastError();
+		else if (dwStatus != 200 && dwStatus != 206)
+			dwError = HttpStatusToError(dwStatus);
+		else
+		{
+			for (;;)
+			{
+				DWORD cbAvailable = 0, cbRead = 0;
+				if (!WinHttpQueryDataAvailable(hRequest, &cbAvailable))
+				{
+					dwError = GetLastError();
+					break;
+				}
+				if (!cbAvailable)
+					break;
+
+				size_t pos = response.length();
+				response.resize(pos + cbAvailable);
+				if (!WinHttpReadData(hRequest, &response[pos], cbAvailable, &cbRead))
+				{
+					dwError = GetLastError();
+					break;
+				}
+				response.resize(pos + cbRead);
+			}
+
+			// a server ignoring the range would send the whole object
+			if (!dwError && cbLength && response.length() != cbLength)
+				dwError = ERROR_INVALID_DATA;
+		}
+
+		WinHttpCloseHandle(hRequest);
+		return dwError;
+	}
+
+	// fetch the chunk on one of the fetch threads, which signal hDone when it
+	// is complete, or synchronously when there are none
+	void QueueFetch(CObjectChunk* pChunk)
+	{
+		if (m_fetchThreads.empty() || !(pChunk->hDone = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		{
+			Fetch(pChunk);
+			return;
+		}
+		EnterCriticalSection(&m_csFetch);
+		m_fetchQueue.push_back(pChunk);
+		LeaveCriticalSection(&m_csFetch);
+		ReleaseSemaphore(m_hFetchSemaphore, 1, NULL);
+	}
+
+	LPCTSTR GetRootName() const { return m_szRootName.c_str();}
+
+	bool IsDirectory(LPCTSTR szPath) const { return !m_bRootIsObject && (m_dirs.find(szPath) != m_dirs.end());}
+
+	DWORD ListDirectory(LPCTSTR szDirPath, list<CDirContent>& dirContent)
+	{
+		map<wstring, map<wstring, CObjectEntry> >::const_iterator itDir = m_dirs.find(szDirPath);
+		if (itDir == m_dirs.end())
+			return ERROR_PATH_NOT_FOUND;
+
+		for (map<wstring, CObjectEntry>::const_iterator it = itDir->second.begin(); it != itDir->second.end(); it++)
+			dirContent.push_back(CDirContent(szDirPath, it->first.c_str(), it->second.bIsDir, it->second.size, it->second.lastWriteTime));
+		return 0;
+	}
+
+	CFileReader* OpenObject(LPCTSTR szPath, DWORD& dwError);
+};
+
+static CObjectStore* g_pObjectStore = NULL;
+
+class CObjectReader : public CFileReader
+{
+protected:
+	CObjectStore* m_pStore;
+	wstring m_szObjectPath;
+	unsigned long long m_size;
+	unsigned long long m_nextChunkStart;
+	size_t m_chunkPos;
+	deque<CObjectChunk*> m_chunks;
+
+	// keep up to g_iHttpConnections ranged GETs in flight ahead of the reading position
+	void FillWindow()
+	{
+		while ((int) m_chunks.size() < g_iHttpConnections && m_nextChunkStart < m_size)
+		{
+			CObjectChunk* pChunk = new CObjectChunk();
+			pChunk->szObjectPath = m_szObjectPath;
+			pChunk->start = m_nextChunkStart;
+			pChunk->cbLength = (DWORD) min((unsigned long long) OBJECT_CHUNK_SIZE, m_size - m_nextChunkStart);
+			pChunk->dwError = 0;
+			pChunk->lCancelled = 0;
+			pChunk->hDone = NULL;
+			m_chunks.push_back(pChunk);
+			m_nextChunkStart += pChunk->cbLength;
+			m_pStore->QueueFetch(pChunk);
+		}
+	}
+
+	void ReleaseChunk(CObjectChunk* pChunk)
+	{
+		if (pChunk->hDone)
+		{
+			// a chunk still queued is skipped by the fetch thread
+			InterlockedExchange(&pChunk->lCancelled, 1);
+			WaitForSingleObject(pChunk->hDone, INFINITE);
+			CloseHandle(pChunk->hDone);
+		}
+		delete pChunk;
+	}
+
+public:
+	CObjectReader(CObjectStore* pStore, const wstring& szObjectPath, unsigned long long size)
+		: m_pStore(pStore), m_szObjectPath(szObjectPath), m_size(size), m_nextChunkStart(0), m_chunkPos(0) {}
+
+	~CObjectReader()
+	{
+		while (!m_chunks.empty())
+		{
+			ReleaseChunk(m_chunks.front());
+			m_chunks.pop_front();
+		}
+	}
+
+	DWORD Read(LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+	{
+		FillWindow();
+		if (m_chunks.empty())
+			return 0;
+
+		CObjectChunk* pChunk = m_chunks.front();
+		if (pChunk->hDone)
+		{
+			while (WaitForSingleObject(pChunk->hDone, 200) == WAIT_TIMEOUT)
+			{
+				if ((dwError = CheckCancellation()) != 0)
+					return 0;
+			}
+		}
+		if (pChunk->dwError)
+		{
+			dwError = pChunk->dwError;
+			return 0;
+		}
+
+		DWORD cbRead = (DWORD) min((size_t) cbBuffer, pChunk->data.length() - m_chunkPos);
+		memcpy(pbBuffer, pChunk->data.data() + m_chunkPos, cbRead);
+		m_chunkPos += cbRead;
+		if (m_chunkPos == pChunk->data.length())
+		{
+			ReleaseChunk(pChunk);
+			m_chunks.pop_front();
+			m_chunkPos = 0;
+		}
+		return cbRead;
+	}
+
+	unsigned long long GetSize() { return m_size;}
+};
+
+CFileReader* CObjectStore::OpenObject(LPCTSTR szPath, DWORD& dwError)
+{
+	unsigned long long size = m_rootSize;
+	if (!m_bRootIsObject)
+	{
+		LPCTSTR szName = _tcsrchr(szPath, _T('\\'));
+		map<wstring, map<wstring, CObjectEntry> >::const_iterator itDir = szName? m_dirs.find(wstring(szPath, szName - szPath)) : m_dirs.end();
+		map<wstring, CObjectEntry>::const_iterator itEntry;
+		if (itDir == m_dirs.end() || (itEntry = itDir->second.find(szName + 1)) == itDir->second.end())
+		{
+			dwError = ERROR_FILE_NOT_FOUND;
+			return NULL;
+		}
+		size = itEntry->second.size;
+	}
+	return new CObjectReader(this, GetObjectPath(szPath), size);
+}
+
+// ---------------------------------------------
+// With -queuedepth, local files are opened for overlapped I/O and up to that
+// many reads of QUEUED_BLOCK_SIZE bytes are kept in flight at consecutive
+// offsets. They are consumed in order by the hashing thread, which reissues
+// each slot further ahead as soon as its data has been hashed. This keeps
+// deep queues on high-latency storage without a thread per request.
+
+#define QUEUED_BLOCK_SIZE (256 * 1024)
+
+static int g_iQueueDepth = 0;
+
+class COverlappedFileReader : public CFileReader
+{
+protected:
+	struct CSlot
+	{
+		OVERLAPPED ov;
+		LPBYTE pbData;
+		unsigned long long offset;
+		bool bPending;
+		DWORD dwIssueError;
+	};
+
+	LPCTSTR m_szFilePath;
+	HANDLE m_hFile;
+	vector<CSlot> m_slots;
+	size_t m_current;		// slot being consumed
+	DWORD m_cbCurrent;
+	DWORD m_currentPos;
+	bool m_bHoldingData;
+	bool m_bEof;
+	unsigned long long m_nextOffset;
+
+	void Issue(CSlot& slot, unsigned long long offset)
+	{
+		slot.offset = offset;
+		slot.ov.Offset = (DWORD) offset;
+		slot.ov.OffsetHigh = (DWORD) (offset >> 32);
+		slot.ov.Internal = slot.ov.InternalHigh = 0;
+		slot.dwIssueError = 0;
+		ResetEvent(slot.ov.hEvent);
+
+		slot.bPending = true;
+		if (!ReadFile(m_hFile, slot.pbData, QUEUED_BLOCK_SIZE, NULL, &slot.ov) && GetLastError() != ERROR_IO_PENDING)
+		{
+			slot.dwIssueError = GetLastError();
+			slot.bPending = false;
+		}
+	}
+
+	// wait for the read of a slot, retrying transient failures at the same offset
+	DWORD Complete(CSlot& slot, DWORD& dwError)
+	{
+		for (int iAttempt = 0; ; iAttempt++)
+		{
+			DWORD cbRead = 0;
+			dwError = slot.dwIssueError;
+			if (slot.bPending)
+			{
+				while (WaitForSingleObject(slot.ov.hEvent, 200) == WAIT_TIMEOUT)
+				{
+					if ((dwError = CheckCancellation()) != 0)
+						return 0;
+				}
+				slot.bPending = false;
+				if (!GetOverlappedResult(m_hFile, &slot.ov, &cbRead, FALSE))
+					dwError = GetLastError();
+			}
+
+			if (dwError == ERROR_HANDLE_EOF)
+				dwError = 0;
+			if (!dwError || !WaitBeforeRetry(dwError, iAttempt))
+				return cbRead;
+
+			Issue(slot, slot.offset);
+		}
+	}
+
+public:
+	COverlappedFileReader(LPCTSTR szFilePath, HANDLE hFile, int iDepth)
+		: m_szFilePath(szFilePath), m_hFile(hFile), m_current(0), m_cbCurrent(0), m_currentPos(0), m_bHoldingData(false), m_bEof(false), m_nextOffset(0)
+	{
+		m_slots.resize(iDepth);
+		for (size_t i = 0; i < m_slots.size(); i++)
+		{
+			ZeroMemory(&m_slots[i].ov, sizeof(OVERLAPPED));
+			m_slots[i].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			m_slots[i].pbData = new BYTE[QUEUED_BLOCK_SIZE];
+			m_slots[i].bPending = false;
+		}
+
+		for (size_t i = 0; i < m_slots.size(); i++)
+		{
+			Issue(m_slots[i], m_nextOffset);
+			m_nextOffset += QUEUED_BLOCK_SIZE;
+		}
+	}
+
+	~COverlappedFileReader()
+	{
+		DWORD cbRead;
+		CancelIo(m_hFile);
+		for (size_t i = 0; i < m_slots.size(); i++)
+		{
+			if (m_slots[i].bPending)
+				GetOverlappedResult(m_hFile, &m_slots[i].ov, &cbRead, TRUE);
+			if (m_slots[i].ov.hEvent) CloseHandle(m_slots[i].ov.hEvent);
+			delete [] m_slots[i].pbData;
+		}
+		CloseHandle(m_hFile);
+	}
+
+	static COverlappedFileReader* Open(LPCTSTR szFilePath, int iDepth, DWORD& dwError)
+	{
+		for (int iAttempt = 0; ; iAttempt++)
+		{
+			HANDLE hFile = CreateFile(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+			if (hFile != INVALID_HANDLE_VALUE)
+				return new COverlappedFileReader(szFilePath, hFile, iDepth);
+
+			dwError = GetLastError();
+			if (!WaitBeforeRetry(dwError, iAttempt))
+				return NULL;
+		}
+	}
+
+	DWORD Read(LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+	{
+		dwError = 0;
+		if (!m_bHoldingData)
+		{
+			if (m_bEof)
+				return 0;
+
+			m_cbCurrent = Complete(m_slots[m_current], dwError);
+			m_currentPos = 0;
+			if (dwError || m_cbCurrent == 0)
+			{
+				m_bEof = true;
+				return 0;
+			}
+			// a short read marks the end of the file as it was when it was read
+			if (m_cbCurrent < QUEUED_BLOCK_SIZE)
+				m_bEof = true;
+			m_bHoldingData = true;
+		}
+
+		DWORD cbRead = min(cbBuffer, m_cbCurrent - m_currentPos);
+		memcpy(pbBuffer, m_slots[m_current].pbData + m_currentPos, cbRead);
+		m_currentPos += cbRead;
+
+		if (m_currentPos == m_cbCurrent)
+		{
+			m_bHoldingData = false;
+			if (!m_bEof)
+			{
+				Issue(m_slots[m_current], m_nextOffset);
+				m_nextOffset += QUEUED_BLOCK_SIZE;
+			}
+			m_current = (m_current + 1) % m_slots.size();
+		}
+		return cbRead;
+	}
+
+	unsigned long long GetSize()
+	{
+		LARGE_INTEGER liFileSize;
+		return GetFileSizeEx(m_hFile, &liFileSize)? (unsigned long long) liFileSize.QuadPart : 0;
+	}
+};
+
+CFileReader* OpenFileForHashing(LPCTSTR szFilePath, DWORD& dwError)
+{
+	if (g_pObjectStore)
+		return g_pObjectStore->OpenObject(szFilePath, dwError);
+
+	if (g_iQueueDepth > 1)
+		return COverlappedFileReader::Open(szFilePath, g_iQueueDepth, dwError);
+
+	HANDLE hFile = OpenLocalFile(szFilePath, dwError);
+	return (hFile != INVALID_HANDLE_VALUE)? new CLocalFileReader(szFilePath, hFile) : NULL;
+}
+
+// ---------------------------------------------
+// With -prefetch, a background thread reads the files that come next in the
+// sorted order so that their data is already in the system cache when they
+// are hashed, keeping the disk busy between the end of a file and the first
+// read of the next one. The prefetcher stays at most g_iPrefetchFiles files
+// and m_cbBudget bytes ahead of the hashing cursor. Files are queued one run
+// of consecutive files at a time, so the prefetch order is the hash order.
+
+static int g_iPrefetchFiles = 0;
+
+class CPrefetcher
+{
+protected:
+	struct CItem
+	{
+		wstring szPath;
+		unsigned long long cbFetched;
+	};
+
+	deque<CItem> m_items;			// m_items[k] has sequence m_base + k
+	unsigned long long m_base;		// number of files consumed by the hashing
+	unsigned long long m_next;		// sequence of the next file to prefetch
+	unsigned long long m_bytesAhead;
+	unsigned long long m_cbBudget;
+	CRITICAL_SECTION m_cs;
+	HANDLE m_hWakeEvent;
+	HANDLE m_hThread;
+	bool m_bStopping;
+	BYTE m_pbBuffer[1024 * 1024];
+
+	bool CanPrefetch() const
+	{
+		return (m_next < m_base + m_items.size()) && (m_next - m_base < (unsigned long long) g_iPrefetchFiles) && (m_bytesAhead < m_cbBudget);
+	}
+
+	void PrefetchFile(const wstring& szPath, unsigned long long seq)
+	{
+		HANDLE hFile = CreateFile(szPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return;
+
+		// errors are ignored: they are reported when the file is hashed
+		DWORD cbRead;
+		while (ReadFile(hFile, m_pbBuffer, sizeof(m_pbBuffer), &cbRead, NULL) && cbRead)
+		{
+			bool bContinue;
+			EnterCriticalSection(&m_cs);
+			bContinue = !m_bStopping && (seq >= m_base);
+			if (bContinue)
+			{
+				m_items[(size_t) (seq - m_base)].cbFetched += cbRead;
+				m_bytesAhead += cbRead;
+				bContinue = (m_bytesAhead < m_cbBudget);
+			}
+			LeaveCriticalSection(&m_cs);
+			if (!bContinue)
+				break;
+		}
+		CloseHandle(hFile);
+	}
+
+	static DWORD WINAPI PrefetchThread(LPVOID pParam)
+	{
+		CPrefetcher* pPrefetcher = (CPrefetcher*) pParam;
+		for (;;)
+		{
+			wstring szPath;
+			unsigned long long seq;
+
+			EnterCriticalSection(&pPrefetcher->m_cs);
+			if (pPrefetcher->m_bStopping)
+			{
+				LeaveCriticalSection(&pPrefetcher->m_cs);
+				break;
+			}
+			// the hashing may have overtaken the prefetching
+			if (pPrefetcher->m_next < pPrefetcher->m_base)
+				pPrefetcher->m_next = pPrefetcher->m_base;
+			bool bCanPrefetch = pPrefetcher->CanPrefetch();
+			if (bCanPrefetch)
+			{
+				seq = pPrefetcher->m_next++;
+				szPath = pPrefetcher->m_items[(size_t) (seq - pPrefetcher->m_base)].szPath;
+			}
+			LeaveCriticalSection(&pPrefetcher->m_cs);
+
+			if (bCanPrefetch)
+				pPrefetcher->PrefetchFile(szPath, seq);
+			else
+				WaitForSingleObject(pPrefetcher->m_hWakeEvent, INFINITE);
+		}
+		return 0;
+	}
+
+public:
+	CPrefetcher() : m_base(0), m_next(0), m_bytesAhead(0), m_hThread(NULL), m_bStopping(false)
+	{
+		MEMORYSTATUSEX memStatus;
+
+		// use at most an eighth of the available memory, within [16 MB, 512 MB]
+		memStatus.dwLength = sizeof(memStatus);
+		m_cbBudget = GlobalMemoryStatusEx(&memStatus)? memStatus.ullAvailPhys / 8 : 0;
+		m_cbBudget = max(m_cbBudget, 16ULL * 1024 * 1024);
+		m_cbBudget = min(m_cbBudget, 512ULL * 1024 * 1024);
+
+		InitializeCriticalSection(&m_cs);
+		m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hWakeEvent)
+			m_hThread = CreateThread(NULL, 0, PrefetchThread, this, 0, NULL);
+	}
+
+	~CPrefetcher()
+	{
+		if (m_hWakeEvent) CloseHandle(m_hWakeEvent);
+		DeleteCriticalSection(&m_cs);
+	}
+
+	bool IsRunning() const { return m_hThread != NULL;}
+
+	void Enqueue(LPCTSTR szPath)
+	{
+		CItem item;
+		item.szPath = szPath;
+		item.cbFetched = 0;
+
+		EnterCriticalSection(&m_cs);
+		m_items.push_back(item);
+		LeaveCriticalSection(&m_cs);
+		SetEvent(m_hWakeEvent);
+	}
+
+	// the oldest queued file has been hashed
+	void Done()
+	{
+		EnterCriticalSection(&m_cs);
+		if (!m_items.empty())
+		{
+			m_bytesAhead -= m_items.front().cbFetched;
+			m_items.pop_front();
+			m_base++;
+		}
+		LeaveCriticalSection(&m_cs);
+		SetEvent(m_hWakeEvent);
+	}
+
+	// returns false if the thread is stuck in an I/O, in which case the object must not be deleted
+	bool Stop()
+	{
+		EnterCriticalSection(&m_cs);
+		m_bStopping = true;
+		LeaveCriticalSection(&m_cs);
+		SetEvent(m_hWakeEvent);
+
+		if (WaitForSingleObject(m_hThread, 5000) == WAIT_TIMEOUT)
+			return false;
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+		return true;
+	}
+};
+
+static CPrefetcher* g_pPrefetcher = NULL;
+
+// whether HashFile will read the file, in which case it goes through the prefetcher
+bool IsPrefetchCandidate(CDirContent& entry, list<wstring>& excludeSpecList)
+{
+	LPCTSTR szPath = entry.GetPath();
+	return !entry.IsDir() && (excludeSpecList.empty() || lstrlen(szPath) > MAX_PATH || !IsExcludedName(szPath, excludeSpecList));
+}
+
+// ---------------------------------------------
+// With -pipeline, reading and hashing are separate stages: a reader thread
+// fills a bounded single-producer/single-consumer ring of blocks from the
+// file being hashed while the main thread hashes the blocks already read.
+// Waits on either side are counted to show which stage limits the run.
+
+#define PIPELINE_BLOCK_SIZE (256 * 1024)
+
+static int g_iPipelineDepth = 0;
+
+class CReadPipeline
+{
+protected:
+	struct CBlock
+	{
+		LPBYTE pbData;
+		DWORD cbData;
+		DWORD dwError;
+		bool bEnd;
+	};
+
+	vector<CBlock> m_ring;
+	size_t m_producerIndex;
+	size_t m_consumerIndex;
+	HANDLE m_hFreeSlots;
+	HANDLE m_hFilledSlots;
+	HANDLE m_hJobEvent;
+	HANDLE m_hThread;
+	CFileReader* volatile m_pSource;
+	volatile LONG m_lAbort;
+	volatile LONG m_lFilled;
+	bool m_bStopping;
+
+	// statistics
+	volatile LONG m_lProducerWaits;
+	unsigned long long m_blocksRead;
+	unsigned long long m_consumerWaits;
+	unsigned long long m_blocksHashed;
+	unsigned long long m_occupancySum;
+
+	void ReadSource(CFileReader* pSource)
+	{
+		for (;;)
+		{
+			if (WaitForSingleObject(m_hFreeSlots, 0) == WAIT_TIMEOUT)
+			{
+				InterlockedIncrement(&m_lProducerWaits);
+				WaitForSingleObject(m_hFreeSlots, INFINITE);
+			}
+
+			CBlock& block = m_ring[m_producerIndex];
+			m_producerIndex = (m_producerIndex + 1) % m_ring.size();
+
+			block.dwError = 0;
+			block.cbData = m_lAbort? 0 : pSource->Read(block.pbData, PIPELINE_BLOCK_SIZE, block.dwError);
+			block.bEnd = (block.cbData == 0);
+			m_blocksRead++;
+
+			InterlockedIncrement(&m_lFilled);
+			ReleaseSemaphore(m_hFilledSlots, 1, NULL);
+			if (block.bEnd)
+				break;
+		}
+	}
+
+	static DWORD WINAPI ReaderThread(LPVOID pParam)
+	{
+		CReadPipeline* pPipeline = (CReadPipeline*) pParam;
+		for (;;)
+		{
+			WaitForSingleObject(pPipeline->m_hJobEvent, INFINITE);
+			if (pPipeline->m_bStopping)
+				break;
+			pPipeline->ReadSource(pPipeline->m_pSource);
+		}
+		return 0;
+	}
+
+public:
+	CReadPipeline(int iDepth) : m_producerIndex(0), m_consumerIndex(0), m_hThread(NULL), m_pSource(NULL), m_lAbort(0), m_lFilled(0), m_bStopping(false),
+		m_lProducerWaits(0), m_blocksRead(0), m_consumerWaits(0), m_blocksHashed(0), m_occupancySum(0)
+	{
+		for (int i = 0; i < iDepth; i++)
+		{
+			CBlock block;
+			block.pbData = new BYTE[PIPELINE_BLOCK_SIZE];
+			block.cbData = 0;
+			block.dwError = 0;
+			block.bEnd = false;
+			m_ring.push_back(block);
+		}
+
+		m_hFreeSlots = CreateSemaphore(NULL, iDepth, iDepth, NULL);
+		m_hFilledSlots = CreateSemaphore(NULL, 0, iDepth, NULL);
+		m_hJobEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hFreeSlots && m_hFilledSlots && m_hJobEvent)
+			m_hThread = CreateThread(NULL, 0, ReaderThread, this, 0, NULL);
+	}
+
+	~CReadPipeline()
+	{
+		for (size_t i = 0; i < m_ring.size(); i++)
+			delete [] m_ring[i].pbData;
+		if (m_hFreeSlots) CloseHandle(m_hFreeSlots);
+		if (m_hFilledSlots) CloseHandle(m_hFilledSlots);
+		if (m_hJobEvent) CloseHandle(m_hJobEvent);
+	}
+
+	bool IsRunning() const { return m_hThread != NULL;}
+
+	// the reader thread starts reading the source, which is consumed with Next/Release
+	void Start(CFileReader* pSource)
+	{
+		m_pSource = pSource;
+		m_lAbort = 0;
+		SetEvent(m_hJobEvent);
+	}
+
+	// wait for the next block read from the current source
+	void Next(LPCBYTE& pbData, DWORD& cbData, DWORD& dwError, bool& bEnd)
+	{
+		if (WaitForSingleObject(m_hFilledSlots, 0) == WAIT_TIMEOUT)
+		{
+			m_consumerWaits++;
+			WaitForSingleObject(m_hFilledSlots, INFINITE);
+		}
+
+		m_occupancySum += (unsigned long long) m_lFilled;
+		m_blocksHashed++;
+
+		CBlock& block = m_ring[m_consumerIndex];
+		pbData = block.pbData;
+		cbData = block.cbData;
+		dwError = block.dwError;
+		bEnd = block.bEnd;
+	}
+
+	// give back the block returned by Next
+	void Release()
+	{
+		m_consumerIndex = (m_consumerIndex + 1) % m_ring.size();
+		InterlockedDecrement(&m_lFilled);
+		ReleaseSemaphore(m_hFreeSlots, 1, NULL);
+	}
+
+	// stop reading the current source early, consuming what is left in the ring
+	void Abort()
+	{
+		LPCBYTE pbData;
+		DWORD cbData, dwError;
+		bool bEnd = false;
+
+		InterlockedExchange(&m_lAbort, 1);
+		while (!bEnd)
+		{
+			Next(pbData, cbData, dwError, bEnd);
+			Release();
+		}
+	}
+
+	void Stop()
+	{
+		m_bStopping = true;
+		SetEvent(m_hJobEvent);
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+	}
+
+	void ShowStatistics()
+	{
+		if (!m_blocksHashed)
+			return;
+
+		_tprintf(_T("Pipeline: %I64u block(s) of %d KB, average ring occupancy %.1f/%d\n"),
+			m_blocksHashed, PIPELINE_BLOCK_SIZE / 1024, (double) m_occupancySum / (double) m_blocksHashed, (int) m_ring.size());
+		_tprintf(_T("  hash stage waited for data on %.1f %% of blocks, read stage waited for a free block on %.1f %% of blocks\n"),
+			100.0 * (double) m_consumerWaits / (double) m_blocksHashed,
+			m_blocksRead? 100.0 * (double) m_lProducerWaits / (double) m_blocksRead : 0.0);
+		if (m_consumerWaits * 2 > m_blocksHashed)
+			_tprintf(_T("  reading is the bottleneck\n"));
+		else if ((unsigned long long) m_lProducerWaits * 2 > m_blocksRead)
+			_tprintf(_T("  hashing is the bottleneck\n"));
+	}
+};
+
+static CReadPipeline* g_pReadPipeline = NULL;
+
+// Reads a file through the pipeline: data is copied out of the ring blocks
+class CPipelinedReader : public CFileReader
+{
+protected:
+	CReadPipeline* m_pPipeline;
+	CFileReader* m_pSource;
+	unsigned long long m_size;
+	LPCBYTE m_pbBlock;
+	DWORD m_cbBlock;
+	DWORD m_blockPos;
+	bool m_bHoldingBlock;
+	bool m_bFinished;
+
+public:
+	CPipelinedReader(CReadPipeline* pPipeline, CFileReader* pSource)
+		: m_pPipeline(pPipeline), m_pSource(pSource), m_pbBlock(NULL), m_cbBlock(0), m_blockPos(0), m_bHoldingBlock(false), m_bFinished(false)
+	{
+		m_size = pSource->GetSize();
+		pPipeline->Start(pSource);
+	}
+
+	~CPipelinedReader()
+	{
+		if (m_bHoldingBlock)
+			m_pPipeline->Release();
+		if (!m_bFinished)
+			m_pPipeline->Abort();
+		delete m_pSource;
+	}
+
+	DWORD Read(LPBYTE pbBuffer, DWORD cbBuffer, DWORD& dwError)
+	{
+		dwError = 0;
+		if (m_bFinished)
+			return 0;
+
+		if (!m_bHoldingBlock)
+		{
+			bool bEnd;
+			m_pPipeline->Next(m_pbBlock, m_cbBlock, dwError, bEnd);
+			m_blockPos = 0;
+			if (bEnd)
+			{
+				m_pPipeline->Release();
+				m_bFinished = true;
+				return 0;
+			}
+			m_bHoldingBlock = true;
+		}
+
+		DWORD cbRead = min(cbBuffer, m_cbBlock - m_blockPos);
+		memcpy(pbBuffer, m_pbBlock + m_blockPos, cbRead);
+		m_blockPos += cbRead;
+		if (m_blockPos == m_cbBlock)
+		{
+			m_pPipeline->Release();
+			m_bHoldingBlock = false;
+		}
+		return cbRead;
+	}
+
+	unsigned long long GetSize() { return m_size;}
+};
+
+// Feed the name of the file or directory at the top of g_namePath into the hash.
+// szPath is the same entry as built by the traversal.
+void HashName(Hash* pHash, LPCTSTR szPath, bool bStripNames)
+{
+	LPCTSTR pNameToHash = NULL;
+	if (g_namePath.GetRawLength() > MAX_PATH)
+		pNameToHash = szPath;
+	else if (bStripNames)
+		pNameToHash = g_namePath.GetLeaf();
+	else
+		pNameToHash = g_namePath.GetPath();
+
+	if (g_profile == PROFILE_PORTABLE)
+	{
+		if (!bStripNames)
+		{
+			// name relative to the parent of the input path, with '/' separators
+			g_szPortableName = g_szRootName;
+			if (!g_namePath.IsRoot())
+			{
+				if (!g_szRootName.empty())
+					g_szPortableName += _T('/');
+				g_szPortableName += g_namePath.GetRelativePath();
+			}
+			for (size_t i = 0; i < g_szPortableName.length(); i++)
+			{
+				if (g_szPortableName[i] == _T('\\'))
+					g_szPortableName[i] = _T('/');
+			}
+			pNameToHash = g_szPortableName.c_str();
+		}
+		else if (g_namePath.GetRawLength() > MAX_PATH)
+			pNameToHash = g_namePath.GetLeaf();
+	}
+	else if (!g_bNormalizeNames)
+	{
+		pHash->Update ((LPCBYTE) pNameToHash, _tcslen (pNameToHash) * sizeof(TCHAR));
+		return;
+	}
+
+	// ASCII fast path: an ASCII name is its own NFC UTF-8 encoding
+	size_t i, len = _tcslen (pNameToHash);
+	g_szUtf8Name.resize(len);
+	if (g_bNormalizeNames)
+	{
+		for (i = 0; i < len && pNameToHash[i] < 0x80; i++)
+			g_szUtf8Name[i] = (char) g_asciiFold[pNameToHash[i]];
+	}
+	else
+	{
+		for (i = 0; i < len && pNameToHash[i] < 0x80; i++)
+			g_szUtf8Name[i] = (char) pNameToHash[i];
+	}
+
+	if (i != len)
+	{
+		NormalizeName (pNameToHash, g_szNormalizedName, g_bNormalizeNames);
+		int cbUtf8 = WideCharToMultiByte (CP_UTF8, 0, g_szNormalizedName.c_str(), (int) g_szNormalizedName.length(), NULL, 0, NULL, NULL);
+		g_szUtf8Name.resize(cbUtf8);
+		if (cbUtf8)
+			WideCharToMultiByte (CP_UTF8, 0, g_szNormalizedName.c_str(), (int) g_szNormalizedName.length(), &g_szUtf8Name[0], cbUtf8, NULL, NULL);
+	}
+
+	pHash->Update ((LPCBYTE) g_szUtf8Name.data(), g_szUtf8Name.length());
+}
+
+// totals of the input computed by -prescan, used to display an overall ETA
+static unsigned long long g_ullPrescanFiles = 0;
+static unsigned long long g_ullPrescanBytes = 0;
+
+// return the file name. If it is too long, it is shortness so that the progress line 
+LPCTSTR GetShortFileName (LPCTSTR szFilePath, unsigned long long fileSize)
+{
+	static TCHAR szShortName[256];
+	size_t l, bufferSize = ARRAYSIZE (szShortName);
+	int maxPrintLen = _scprintf (" [==========] 100.00 %% (%ull/%ull)", fileSize, fileSize); // 10 steps for progress bar
+	if (g_ullPrescanBytes)
+		maxPrintLen += _scprintf (" | total 100.0 %% ETA 00:00:00");
+	LPCTSTR ptr = &szFilePath [_tcslen (szFilePath) - 1];
+
+	// Get file name part from the path
+	while ((ptr != szFilePath) && (*ptr != _T('\\')) && (*ptr != _T('/')))
+	{
+		ptr--;
+	}
+	ptr++;
+
+	// calculate maximum length for file name	
+	bufferSize = (g_originalConsoleInfo.dwSize.X > (maxPrintLen+1))? min (256, (g_originalConsoleInfo.dwSize.X - 1 - maxPrintLen)) : 9;
+
+	l = _tcslen (ptr);
+	if (l < bufferSize)
+		_tcscpy (szShortName, ptr);
+	else
+	{
+		size_t prefixLen = (bufferSize / 2 - 2);
+		size_t suffixLen = bufferSize - prefixLen - 4;
+
+		memcpy (szShortName, ptr, prefixLen * sizeof (TCHAR));
+		memcpy (((unsigned char*) szShortName) + prefixLen * sizeof (TCHAR), _T("..."), 3 * sizeof (TCHAR));
+		memcpy (((unsigned char*) szShortName) + (prefixLen + 3)* sizeof (TCHAR), ptr + (l - suffixLen), suffixLen * sizeof (TCHAR));
+		szShortName [bufferSize - 1] = 0;
+	}
+	return szShortName;
+}
+
+// Append the overall completion and the estimated remaining time, based on the average rate so far
+void DisplayOverallProgress (unsigned long long bytesDone, unsigned long long totalBytes)
+{
+	double elapsed = (double) (GetTickCount() - g_dwStartTicks) / 1000.0;
+	double pourcentage = totalBytes? ((double) bytesDone / (double) totalBytes) * 100.0 : 100.0;
+
+	_tprintf (_T(" | total %.1f %%"), pourcentage);
+	if (bytesDone && elapsed >= 1.0 && bytesDone < totalBytes)
+	{
+		unsigned long long remaining = (unsigned long long) (elapsed * (double) (totalBytes - bytesDone) / (double) bytesDone);
+		_tprintf (_T(" ETA %.2I64u:%.2I64u:%.2I64u"), remaining / 3600, (remaining / 60) % 60, remaining % 60);
+	}
+}
+
+void DisplayProgress (LPCTSTR szFileName, unsigned long long currentSize, unsigned long long fileSize, clock_t startTime, clock_t &lastBlockTime)
+{
+	clock_t t = clock ();
+	if (lastBlockTime == 0 || currentSize == fileSize || ((t - lastBlockTime) >= CLOCKS_PER_SEC))
+	{
+		unsigned long long maxPos = 10ull;
+		// the file may have grown since it was opened
+		unsigned long long pos = (currentSize >= fileSize)? maxPos : (currentSize * maxPos) / fileSize;
+		double pourcentage = (currentSize >= fileSize)? 100.0 : ((double) currentSize / (double) fileSize) * 100.0;
+
+		lastBlockTime = t;
+
+		_tprintf (_T("\r%s ["), szFileName);
+		for (unsigned long long i = 0; i < maxPos; i++)
+		{
+			if (i < pos)
+				_tprintf (_T("="));
+			else
+				_tprintf (_T(" "));
+		}
+		_tprintf (_T("] %.2f %% (%llu/%llu)"), pourcentage, currentSize, fileSize);
+		if (g_ullPrescanBytes)
+			DisplayOverallProgress (g_ullBytesDone + currentSize, g_ullPrescanBytes);
+
+		_tprintf (_T("\r"));
+	}
+}
+
+void ClearProgress ()
+{
+	_tprintf (_T("\r"));
+	for (int i = 0; i < g_originalConsoleInfo.dwSize.X - 1; i++)
+	{
+		_tprintf (_T(" "));
+	}
+
+	_tprintf (_T("\r"));
+}
+
+// With -cachefirst, files are hashed out of order: HashFile then stores the
+// outcome of each file here instead of reporting it, and its caller reports
+// the outcomes in the output order.
+struct CFileOutcome
+{
+	wstring szDigest;
+	LPCTSTR szFailedPhase;	// NULL unless the file failed
+	DWORD dwError;
+	unsigned long long size;
+};
+
+static CFileOutcome* g_pCapturedOutcome = NULL;
+
+// Report the failure of a file in the given phase ("open", "read" or "hash").
+// Returns the error to propagate, which is 0 when the run must continue.
+DWORD ReportFileError(LPCTSTR szPhase, LPCTSTR szFilePath, DWORD dwError)
+{
+	if (szPhase[0] == _T('o'))
+		_tprintf(TEXT("Failed to open file \"%s\" for reading (error 0x%.8X)\n"), szFilePath, dwError);
+	else if (szPhase[0] == _T('h'))
+		_tprintf(TEXT("Failed to compute the hash of file \"%s\" (error 0x%.8X)\n"), szFilePath, dwError);
+	else
+		_tprintf(TEXT("Failed to read file \"%s\" (error 0x%.8X)\n"), szFilePath, dwError);
+	return RecordError(szPhase, szFilePath, dwError);
+}
+
+DWORD FileFailed(LPCTSTR szPhase, LPCTSTR szFilePath, DWORD dwError)
+{
+	if (!g_pCapturedOutcome)
+		return ReportFileError(szPhase, szFilePath, dwError);
+
+	g_pCapturedOutcome->szFailedPhase = szPhase;
+	g_pCapturedOutcome->dwError = dwError;
+	return 0;
+}
+
+void EmitSumLine(LPCTSTR szDigest, LPCTSTR szFilePath, bool bQuiet)
+{
+	// display hash in yellow
+	SetConsoleTextAttribute (g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+
+	if (!bQuiet) _tprintf(_T("%s  %s\n"),szDigest, szFilePath);
+	if (outputFile) OutputPrintf(_T("%s  %s\n"),szDigest, szFilePath);
+
+	// restore normal text color
+	SetConsoleTextAttribute (g_hConsole, g_wAttributes);
+}
+
+DWORD HashFile(LPCTSTR szFilePath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress, bool bSumMode)
+{
+	DWORD dwError = 0;
+	CFileReader* pReader = NULL;
+	int pathLen = lstrlen(szFilePath);
+
+	if (pathLen <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szFilePath, excludeSpecList))
+		return 0;
+
+	if (bSumMode)
+		pHash = Hash::GetHash (pHash->GetID());
+
+	if (bIncludeNames)
+		HashName (pHash, szFilePath, bStripNames);
+
+	pReader = OpenFileForHashing(szFilePath, dwError);
+	if (pReader && g_pReadPipeline)
+		pReader = new CPipelinedReader(g_pReadPipeline, pReader);
+	if (pReader)
+	{
+		DWORD len;
+		bShowProgress = !bQuiet && bShowProgress;
+		// the listed size is 0 for a symbolic link and may be outdated: ask the opened file
+		unsigned long long fileSize = bShowProgress? pReader->GetSize() : 0;
+		unsigned long long currentSize = 0;
+		clock_t startTime = bShowProgress? clock () : 0;
+		clock_t lastBlockTime = 0;
+		LPCTSTR szFileName = bShowProgress? GetShortFileName (szFilePath, fileSize) : NULL;
+
+		while (  (len = pReader->Read(g_pbBuffer, sizeof(g_pbBuffer), dwError)) != 0)
+		{
+			currentSize += (unsigned long long) len;
+			pHash->Update(g_pbBuffer, len);
+			if (bShowProgress)
+				DisplayProgress (szFileName, currentSize, fileSize, startTime, lastBlockTime);
+
+			if ((dwError = CheckCancellation()) != 0)
+				break;
+		}
+
+		if (bShowProgress)
+			ClearProgress ();
+
+		delete pReader;
+
+		if (dwError == ERROR_CANCELLED || dwError == ERROR_TIMEOUT)
+		{
+			if (!g_pCapturedOutcome)
+				ShowPartialReport (dwError, szFilePath);
+		}
+		else if (dwError)
+		{
+			dwError = FileFailed(_T("read"), szFilePath, dwError);
+			if (bSumMode)
+			{
+				delete pHash;
+				return dwError;
+			}
+		}
+		else if (g_pCapturedOutcome)
+			g_pCapturedOutcome->size = currentSize;
+		else
+		{
+			g_ullFilesDone++;
+			g_ullBytesDone += currentSize;
+			g_szLastFileDone = szFilePath;
+		}
+
+		if (bSumMode && !dwError)
+		{
+			pHash->Final(pbDigest);
+			if ((dwError = pHash->GetError()) != 0)
+			{
+				dwError = FileFailed(_T("hash"), szFilePath, dwError);
+				delete pHash;
+				return dwError;
+			}
+
+			DigestEncode (g_digestEncoding, pbDigest, pHash->GetHashSize(), szDigestHex);
+
+			if (g_pCapturedOutcome)
+				g_pCapturedOutcome->szDigest = szDigestHex;
+			else
+				EmitSumLine(szDigestHex, szFilePath, bQuiet);
+		}
+	}
+	else if (dwError == ERROR_CANCELLED || dwError == ERROR_TIMEOUT)
+	{
+		if (!g_pCapturedOutcome)
+			ShowPartialReport (dwError, szFilePath);
+	}
+	else
+		dwError = FileFailed(_T("open"), szFilePath, dwError);
+
+	if (bSumMode)
+		delete pHash;
+	return dwError;
+}
+
+// ---------------------------------------------
+// With -cachefirst (-sum only), each run of consecutive files of a directory
+// is first probed: an overlapped read of the beginning of a file completes
+// immediately when its data is in the system cache and is left pending
+// otherwise. Cached files are hashed right away while the others are read
+// ahead by the prefetcher, then the uncached ones are hashed. The digests,
+// the failures and the progress counters are then reported in the original
+// order, exactly as a sequential run would, up to the first file that was not
+// completed. A probe left pending is cancelled and completes on a thread of
+// the system pool, so hashing never waits for it. Only the first 64 KB are
+// probed: a file whose beginning is cached but not the rest is hashed in the
+// first pass and read from the disk then, which costs time but not accuracy.
+
+#define CACHE_PROBE_SIZE (64 * 1024)
+
+static bool g_bCacheFirst = false;
+static unsigned long long g_ullCachedFiles = 0;
+static unsigned long long g_ullCachedBytes = 0;
+static unsigned long long g_ullUncachedFiles = 0;
+static unsigned long long g_ullUncachedBytes = 0;
+
+struct CCacheProbe
+{
+	OVERLAPPED ov;			// first member: the completion routine receives its address
+	HANDLE hFile;
+	volatile LONG lRefs;	// held by IsFileCached and by the pending read
+	BYTE pbData[CACHE_PROBE_SIZE];
+};
+
+void ReleaseCacheProbe(CCacheProbe* pProbe)
+{
+	if (InterlockedDecrement(&pProbe->lRefs) == 0)
+	{
+		CloseHandle(pProbe->hFile);
+		delete pProbe;
+	}
+}
+
+VOID CALLBACK CacheProbeCompleted(DWORD dwErrorCode, DWORD cbTransferred, LPOVERLAPPED pOverlapped)
+{
+	ReleaseCacheProbe((CCacheProbe*) pOverlapped);
+}
+
+bool IsFileCached(LPCTSTR szFilePath)
+{
+	CCacheProbe* pProbe;
+	bool bCached = false;
+
+	HANDLE hFile = CreateFile(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!BindIoCompletionCallback(hFile, CacheProbeCompleted, 0))
+	{
+		CloseHandle(hFile);
+		return false;
+	}
+
+	pProbe = new CCacheProbe;
+	ZeroMemory(&pProbe->ov, sizeof(pProbe->ov));
+	pProbe->hFile = hFile;
+	pProbe->lRefs = 2;
+
+	// a read completing at once also queues its completion
+	if (ReadFile(hFile, pProbe->pbData, CACHE_PROBE_SIZE, NULL, &pProbe->ov))
+		bCached = true;
+	else if (GetLastError() == ERROR_IO_PENDING)
+	{
+		// the data has to come from the disk: leave it to the prefetcher
+		CancelIo(hFile);
+	}
+	else
+	{
+		// nothing was queued; an empty file has nothing to read
+		bCached = (GetLastError() == ERROR_HANDLE_EOF);
+		ReleaseCacheProbe(pProbe);
+	}
+
+	ReleaseCacheProbe(pProbe);
+	return bCached;
+}
+
+DWORD HashFilesCacheFirst(list<CDirContent>::iterator itBegin, list<CDirContent>::iterator itEnd, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress)
+{
+	vector<CDirContent*> files;
+	vector<bool> cached;
+	vector<CFileOutcome> outcomes;
+	vector<bool> done;
+	size_t firstFailure;
+	DWORD dwError = 0;
+
+	for (list<CDirContent>::iterator it = itBegin; it != itEnd; it++)
+	{
+		unsigned long long size = it->GetSize();
+		// excluded files are not read: they are skipped in the first pass and not counted
+		bool bExcluded = !IsPrefetchCandidate(*it, excludeSpecList);
+		bool bCached = bExcluded || IsFileCached(it->GetPath());
+
+		files.push_back(&(*it));
+		cached.push_back(bCached);
+		if (bExcluded)
+			continue;
+		if (bCached)
+		{
+			g_ullCachedFiles++;
+			g_ullCachedBytes += size;
+		}
+		else
+		{
+			g_ullUncachedFiles++;
+			g_ullUncachedBytes += size;
+			if (g_pPrefetcher)
+				g_pPrefetcher->Enqueue(it->GetPath());
+		}
+	}
+	outcomes.resize(files.size());
+	done.resize(files.size(), false);
+	firstFailure = files.size();
+
+	for (int pass = 0; pass < 2 && !dwError; pass++)
+	{
+		bool bCachedPass = (pass == 0);
+		// without -continue, files after a failure will not be reported
+		for (size_t i = 0; i < files.size() && i <= firstFailure; i++)
+		{
+			if (cached[i] != bCachedPass)
+				continue;
+
+			if ((dwError = CheckCancellation()) != 0)
+				break;
+
+			size_t cchParentName = bIncludeNames? g_namePath.Push(files[i]->GetName()) : 0;
+
+			outcomes[i].szFailedPhase = NULL;
+			outcomes[i].dwError = 0;
+			outcomes[i].size = 0;
+			g_pCapturedOutcome = &outcomes[i];
+			dwError = HashFile(files[i]->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, true);
+			g_pCapturedOutcome = NULL;
+			if (!bCachedPass && g_pPrefetcher)
+				g_pPrefetcher->Done();
+
+			if (bIncludeNames)
+				g_namePath.Pop(cchParentName);
+
+			if (dwError)
+				break;
+			done[i] = true;
+			if (outcomes[i].szFailedPhase && !g_bContinueOnError && i < firstFailure)
+				firstFailure = i;
+		}
+	}
+
+	// also on failure, so that the outcomes of all the files preceding it are reported
+	size_t next = 0;
+	for (; next < files.size() && done[next]; next++)
+	{
+		CFileOutcome& outcome = outcomes[next];
+		if (outcome.szFailedPhase)
+		{
+			DWORD dwReportError = ReportFileError(outcome.szFailedPhase, files[next]->GetPath(), outcome.dwError);
+			if (dwReportError)
+			{
+				dwError = dwReportError;
+				break;
+			}
+		}
+		else if (!outcome.szDigest.empty())
+		{
+			EmitSumLine(outcome.szDigest.c_str(), files[next]->GetPath(), bQuiet);
+			g_ullFilesDone++;
+			g_ullBytesDone += outcome.size;
+			g_szLastFileDone = files[next]->GetPath();
+		}
+	}
+
+	if (dwError == ERROR_CANCELLED || dwError == ERROR_TIMEOUT)
+		ShowPartialReport (dwError, (next < files.size())? files[next]->GetPath() : NULL);
+	return dwError;
+}
+
+// Without bReportErrors, failures are only returned: they will be reported when the directory is hashed
+DWORD ListLocalDirectory(LPCTSTR szDirPath, list<CDirContent>& dirContent, bool bReportErrors = true)
+{
+	wstring szDir;
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	DWORD dwError=0;
+
+	szDir += szDirPath;
+	szDir += _T("\\*");
+
+	// Find the first file in the directory.
+
+	hFind = FindFirstFile(szDir.c_str(), &ffd);
+
+	if (INVALID_HANDLE_VALUE == hFind) 
+	{
+		dwError = GetLastError();
+		if (!bReportErrors)
+			return dwError;
+		_tprintf(TEXT("FindFirstFile failed on \"%s\" with error 0x%.8X.\n"), szDirPath, dwError);
+		return RecordError(_T("list"), szDirPath, dwError);
+	} 
+
+	// List all the files in the directory with some info about them.
+
+	do
+	{
+		if ((dwError = CheckCancellation()) != 0)
+		{
+			FindClose(hFind);
+			if (bReportErrors)
+				ShowPartialReport (dwError, szDirPath);
+			return dwError;
+		}
+
+		if (  (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			// Skip "." and ".." directories
+			if ( (_tcscmp(ffd.cFileName, _T(".")) != 0) && (_tcscmp(ffd.cFileName, _T("..")) != 0))
+				dirContent.push_back(CDirContent(szDirPath, ffd));
+		}
+		else
+		{
+			dirContent.push_back(CDirContent(szDirPath, ffd));
+		}
+	}
+	while (FindNextFile(hFind, &ffd) != 0);
+
+	dwError = GetLastError();
+	if (dwError != ERROR_NO_MORE_FILES) 
+	{
+		FindClose(hFind);
+		dirContent.clear();
+		if (!bReportErrors)
+			return dwError;
+		_tprintf(TEXT("FindNextFile failed while listing \"%s\". \n Error 0x%.8X.\n"), szDirPath, dwError);
+		return RecordError(_T("list"), szDirPath, dwError);
+	}
+
+	FindClose(hFind);
+	return 0;
+}
+
+// ---------------------------------------------
+// -gitignore: .gitignore and .ignore files are applied hierarchically, as git
+// does. The rules of a directory are compiled once, when it is listed, and
+// chained to those of its parent; directories without ignore files share the
+// rule set of their parent. Ignored entries are removed from the listing, so
+// ignored directories are never enumerated. Matching is case insensitive, like
+// git with core.ignorecase on Windows.
+
+enum IgnorePatternKind
+{
+	IGNORE_LITERAL,		// no wildcard: compared with the whole subject
+	IGNORE_SUFFIX,		// "*" followed by a literal, e.g. "*.obj"
+	IGNORE_GLOB
+};
+
+struct CIgnorePattern
+{
+	wstring szPattern;	// lower case, without "!", leading "/" or trailing "/"
+	IgnorePatternKind kind;
+	bool bNegate;
+	bool bDirOnly;
+	bool bAnchored;		// contains a "/": matched against the path relative to the ignore file
+};
+
+// Shell-like matching where "*", "?" and "[...]" never match "/", "**/" matches
+// any number of directories and a trailing "**" matches everything
+bool MatchIgnoreGlob(LPCWSTR p, LPCWSTR s)
+{
+	while (*p)
+	{
+		switch (*p)
+		{
+		case _T('*'):
+			if (p[1] == _T('*'))
+			{
+				LPCWSTR rest = p + 2;
+				if (*rest == 0)
+					return true;
+				if (*rest == _T('/'))
+				{
+					for (rest++; ; s++)
+					{
+						if (MatchIgnoreGlob(rest, s))
+							return true;
+						if ((s = wcschr(s, _T('/'))) == NULL)
+							return false;
+					}
+				}
+				p++;	// any other "**" is a single "*"
+			}
+			for (p++; ; s++)
+			{
+				if (MatchIgnoreGlob(p, s))
+					return true;
+				if (*s == 0 || *s == _T('/'))
+					return false;
+			}
+
+		case _T('?'):
+			if (*s == 0 || *s == _T('/'))
+				return false;
+			p++;
+			s++;
+			break;
+
+		case _T('['):
+			{
+				LPCWSTR q = p + 1;
+				bool bNegate = (*q == _T('!') || *q == _T('^'));
+				bool bMatched = false;
+				if (bNegate)
+					q++;
+				for (bool bFirst = true; *q && (*q != _T(']') || bFirst); q++, bFirst = false)
+				{
+					WCHAR low = *q, high = *q;
+					if (q[1] == _T('-') && q[2] && q[2] != _T(']'))
+					{
+						high = q[2];
+						q += 2;
+					}
+					if (*s >= low && *s <= high)
+						bMatched = true;
+				}
+
+				if (*q == _T(']'))
+				{
+					if (*s == 0 || *s == _T('/') || bMatched == bNegate)
+						return false;
+					p = q + 1;
+					s++;
+					break;
+				}
+			}
+			// no closing bracket: "[" is a literal
+			if (*s != *p)
+				return false;
+			p++;
+			s++;
+			break;
+
+		case _T('\\'):
+			if (p[1])
+				p++;
+			// fall through
+		default:
+			if (*s != *p)
+				return false;
+			p++;
+			s++;
+			break;
+		}
+	}
+
+	return (*s == 0);
+}
+
+class CIgnoreRules
+{
+protected:
+	const CIgnoreRules* m_pParent;
+	size_t m_cchBase;		// length of the directory path including its separator
+	vector<CIgnorePattern> m_patterns;
+
+	static bool Matches(const CIgnorePattern& pattern, LPCWSTR szSubject, size_t cchSubject)
+	{
+		switch (pattern.kind)
+		{
+		case IGNORE_LITERAL:
+			return (cchSubject == pattern.szPattern.length()) && (wcscmp(szSubject, pattern.szPattern.c_str()) == 0);
+		case IGNORE_SUFFIX:
+			{
+				size_t cchSuffix = pattern.szPattern.length() - 1;
+				return (cchSubject >= cchSuffix) && (wcscmp(szSubject + cchSubject - cchSuffix, pattern.szPattern.c_str() + 1) == 0);
+			}
+		default:
+			return MatchIgnoreGlob(pattern.szPattern.c_str(), szSubject);
+		}
+	}
+
+public:
+	CIgnoreRules(const CIgnoreRules* pParent, LPCTSTR szDirPath) : m_pParent(pParent)
+	{
+		m_cchBase = lstrlen(szDirPath);
+		if (m_cchBase && szDirPath[m_cchBase - 1] != _T('\\') && szDirPath[m_cchBase - 1] != _T('/'))
+			m_cchBase++;
+	}
+
+	bool IsEmpty() const { return m_patterns.empty();}
+
+	void AddLine(wstring szLine)
+	{
+		CIgnorePattern pattern;
+		size_t cchLine = szLine.length();
+
+		// trailing spaces are ignored unless escaped with a backslash
+		while (cchLine && (szLine[cchLine - 1] == _T('\r') || szLine[cchLine - 1] == _T(' ')))
+		{
+			if (szLine[cchLine - 1] == _T(' ') && cchLine > 1 && szLine[cchLine - 2] == _T('\\'))
+				break;
+			cchLine--;
+		}
+		szLine.resize(cchLine);
+		if (szLine.empty() || szLine[0] == _T('#'))
+			return;
+
+		pattern.bNegate = (szLine[0] == _T('!'));
+		if (pattern.bNegate)
+			szLine.erase(0, 1);
+
+		pattern.bDirOnly = !szLine.empty() && (szLine[szLine.length() - 1] == _T('/'));
+		if (pattern.bDirOnly)
+			szLine.erase(szLine.length() - 1);
+
+		pattern.bAnchored = (szLine.find(_T('/')) != wstring::npos);
+		if (pattern.bAnchored && szLine[0] == _T('/'))
+			szLine.erase(0, 1);
+		if (szLine.empty())
+			return;
+
+		CharLowerBuff(&szLine[0], (DWORD) szLine.length());
+		if (szLine.find_first_of(_T("*?[\\")) == wstring::npos)
+			pattern.kind = IGNORE_LITERAL;
+		else if (szLine[0] == _T('*') && szLine.find_first_of(_T("*?[\\"), 1) == wstring::npos && !pattern.bAnchored)
+			pattern.kind = IGNORE_SUFFIX;
+		else
+			pattern.kind = IGNORE_GLOB;
+
+		pattern.szPattern = szLine;
+		m_patterns.push_back(pattern);
+	}
+
+	// Read a .gitignore or .ignore file; a missing file adds no rule
+	void AddFile(LPCTSTR szFilePath)
+	{
+		HANDLE hFile = CreateFile(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER liFileSize;
+		DWORD cbRead = 0;
+		string content;
+
+		if (hFile == INVALID_HANDLE_VALUE)
+			return;
+		if (GetFileSizeEx(hFile, &liFileSize) && liFileSize.QuadPart > 0 && liFileSize.QuadPart <= 4 * 1024 * 1024)
+		{
+			content.resize((size_t) liFileSize.QuadPart);
+			if (!ReadFile(hFile, &content[0], (DWORD) content.length(), &cbRead, NULL))
+				cbRead = 0;
+			content.resize(cbRead);
+		}
+		CloseHandle(hFile);
+
+		if (content.length() >= 3 && content.compare(0, 3, "\xEF\xBB\xBF") == 0)
+			content.erase(0, 3);
+
+		wstring szContent = FromUtf8(content);
+		for (size_t pos = 0; pos < szContent.length(); )
+		{
+			size_t eol = szContent.find(_T('\n'), pos);
+			if (eol == wstring::npos)
+				eol = szContent.length();
+			AddLine(szContent.substr(pos, eol - pos));
+			pos = eol + 1;
+		}
+	}
+
+	// szPath is the lower case full path of the entry with '/' separators.
+	// The last matching pattern decides, and deeper ignore files take precedence.
+	bool IsIgnored(LPCWSTR szPath, size_t cchPath, LPCWSTR szName, bool bIsDir) const
+	{
+		for (const CIgnoreRules* pRules = this; pRules; pRules = pRules->m_pParent)
+		{
+			if (pRules->m_cchBase >= cchPath)
+				continue;
+			LPCWSTR szRelative = szPath + pRules->m_cchBase;
+			size_t cchRelative = cchPath - pRules->m_cchBase;
+			size_t cchName = cchPath - (szName - szPath);
+
+			for (vector<CIgnorePattern>::const_reverse_iterator it = pRules->m_patterns.rbegin(); it != pRules->m_patterns.rend(); it++)
+			{
+				if (it->bDirOnly && !bIsDir)
+					continue;
+				if (it->bAnchored? Matches(*it, szRelative, cchRelative) : Matches(*it, szName, cchName))
+					return !it->bNegate;
+			}
+		}
+		return false;
+	}
+};
+
+// Rule sets of the directories listed so far, by directory path
+class CIgnoreTree
+{
+protected:
+	wstring m_szRoot;
+	map<wstring, const CIgnoreRules*> m_dirRules;
+	vector<CIgnoreRules*> m_ownedRules;
+
+	static bool IsIgnoreFile(const CDirContent& entry)
+	{
+		return !entry.IsDir() && (_tcsicmp(entry.GetName(), _T(".gitignore")) == 0 || _tcsicmp(entry.GetName(), _T(".ignore")) == 0);
+	}
+
+	// pListing, when given, avoids opening ignore files that do not exist
+	const CIgnoreRules* GetRules(const wstring& szDirPath, const list<CDirContent>* pListing)
+	{
+		map<wstring, const CIgnoreRules*>::iterator it = m_dirRules.find(szDirPath);
+		if (it != m_dirRules.end())
+			return it->second;
+
+		// directories above the root are not considered; the parent of the
+		// subdirectory of a worker process is built on demand
+		const CIgnoreRules* pParent = NULL;
+		size_t separator = szDirPath.find_last_of(_T("\\/"));
+		if (szDirPath.length() > m_szRoot.length() && separator != wstring::npos && separator >= m_szRoot.length())
+			pParent = GetRules(szDirPath.substr(0, separator), NULL);
+
+		CIgnoreRules* pRules = new CIgnoreRules(pParent, szDirPath.c_str());
+		LPCTSTR ignoreFiles[] = { _T(".gitignore"), _T(".ignore") };	// .ignore takes precedence
+		for (int i = 0; i < ARRAYSIZE(ignoreFiles); i++)
+		{
+			CDirContent file(szDirPath.c_str(), ignoreFiles[i], false);
+			if (pListing)
+			{
+				list<CDirContent>::const_iterator itFile = pListing->begin();
+				while (itFile != pListing->end() && !(IsIgnoreFile(*itFile) && _tcsicmp(itFile->GetName(), ignoreFiles[i]) == 0))
+					itFile++;
+				if (itFile == pListing->end())
+					continue;
+			}
+			pRules->AddFile(file.GetPath());
+		}
+
+		if (pRules->IsEmpty())
+		{
+			delete pRules;
+			return m_dirRules[szDirPath] = pParent;
+		}
+		m_ownedRules.push_back(pRules);
+		return m_dirRules[szDirPath] = pRules;
+	}
+
+public:
+	~CIgnoreTree()
+	{
+		for (size_t i = 0; i < m_ownedRules.size(); i++)
+			delete m_ownedRules[i];
+	}
+
+	// without trailing separator, so that a directory has a single key whatever its caller
+	static wstring GetDirKey(LPCTSTR szDirPath)
+	{
+		wstring szKey = szDirPath;
+		while (szKey.length() > 1 && (szKey[szKey.length() - 1] == _T('\\') || szKey[szKey.length() - 1] == _T('/')))
+			szKey.erase(szKey.length() - 1);
+		return szKey;
+	}
+
+	void SetRoot(LPCTSTR szRootPath) { m_szRoot = GetDirKey(szRootPath);}
+
+	// Remove the ignored entries, and the .git directories, from the listing of szDirPath
+	void Apply(LPCTSTR szDirPath, list<CDirContent>& dirContent)
+	{
+		const CIgnoreRules* pRules = GetRules(GetDirKey(szDirPath), &dirContent);
+		wstring szPath;
+
+		for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); )
+		{
+			bool bIgnored = it->IsDir() && _tcsicmp(it->GetName(), _T(".git")) == 0;
+			if (!bIgnored && pRules)
+			{
+				szPath = it->GetPath();
+				CharLowerBuff(&szPath[0], (DWORD) szPath.length());
+				for (size_t i = 0; i < szPath.length(); i++)
+				{
+					if (szPath[i] == _T('\\'))
+						szPath[i] = _T('/');
+				}
+				size_t nameOffset = wcslen(it->GetPath()) - wcslen(it->GetName());
+				bIgnored = pRules->IsIgnored(szPath.c_str(), szPath.length(), szPath.c_str() + nameOffset, it->IsDir());
+			}
+
+			if (bIgnored)
+				it = dirContent.erase(it);
+			else
+				it++;
+		}
+	}
+};
+
+static CIgnoreTree g_ignoreTree;
+
+bool IsFilteredOut(const CDirContent& entry)
+{
+	if (entry.IsDir())
+		return false;
+
+	unsigned long long size = entry.GetSize(), lastWriteTime = entry.GetLastWriteTime();
+	return (size < g_ullMinSize) || (size > g_ullMaxSize)
+		|| (g_ullNewerThan && lastWriteTime < g_ullNewerThan)
+		|| (g_ullOlderThan && lastWriteTime >= g_ullOlderThan);
+}
+
+// List a local or object store directory, without the files rejected by the filters
+// and, for local directories, the entries ignored by -gitignore
+DWORD ListDirectoryContent(LPCTSTR szDirPath, list<CDirContent>& dirContent, bool bReportErrors = true)
+{
+	DWORD dwError;
+	if (g_pObjectStore)
+		dwError = g_pObjectStore->ListDirectory(szDirPath, dirContent);
+	else
+	{
+		dwError = ListLocalDirectory(szDirPath, dirContent, bReportErrors);
+		if (g_bGitIgnore && !dwError)
+			g_ignoreTree.Apply(szDirPath, dirContent);
+	}
+
+	if (g_bFilterFiles)
+		dirContent.remove_if(IsFilteredOut);
+	return dwError;
+}
+
+// Stable sort that takes advantage of the existing order. Listings are often
+// already sorted (NTFS returns entries ordered by upcased name), which is
+// detected in a single pass without moving anything, and a reversed listing is
+// just reversed. A listing made of a few sorted runs is cut into these runs,
+// which are then merged pairwise; with more runs, list::sort is faster. The
+// result is always the same as that of list::sort since all of them are stable.
+#define ADAPTIVE_SORT_MAX_RUNS	32
+
+template <class Compare>
+void AdaptiveSort(list<CDirContent>& dirContent, Compare comp)
+{
+	list<CDirContent>::iterator it, itNext;
+	bool bDescending = true;
+	size_t descents = 0;
+
+	for (it = dirContent.begin(); it != dirContent.end(); it = itNext)
+	{
+		itNext = it;
+		if (++itNext == dirContent.end())
+			break;
+		if (comp(*itNext, *it))
+			descents++;
+		else
+			bDescending = false;
+		if (!bDescending && descents >= ADAPTIVE_SORT_MAX_RUNS)
+			break;
+	}
+
+	if (descents == 0)
+		return;
+	if (bDescending)
+	{
+		dirContent.reverse();
+		return;
+	}
+	if (descents >= ADAPTIVE_SORT_MAX_RUNS)
+	{
+		dirContent.sort(comp);
+		return;
+	}
+
+	vector< list<CDirContent> > runs;
+	while (!dirContent.empty())
+	{
+		it = dirContent.begin();
+		itNext = it;
+		++itNext;
+		if (itNext != dirContent.end() && comp(*itNext, *it))
+		{
+			while (itNext != dirContent.end() && comp(*itNext, *it))
+				it = itNext++;
+			runs.push_back(list<CDirContent>());
+			runs.back().splice(runs.back().end(), dirContent, dirContent.begin(), itNext);
+			runs.back().reverse();
+		}
+		else
+		{
+			while (itNext != dirContent.end() && !comp(*itNext, *it))
+				it = itNext++;
+			runs.push_back(list<CDirContent>());
+			runs.back().splice(runs.back().end(), dirContent, dirContent.begin(), itNext);
+		}
+	}
+
+	// merge neighbouring runs, the left one first so that equal entries keep their order
+	for (size_t count = runs.size(); count > 1; count = (count + 1) / 2)
+	{
+		for (size_t i = 0; i + 1 < count; i += 2)
+		{
+			runs[i].merge(runs[i + 1], comp);
+			runs[i / 2].swap(runs[i]);
+		}
+		if (count % 2)
+			runs[count / 2].swap(runs[count - 1]);
+	}
+	dirContent.swap(runs[0]);
+}
+
+void SortDirContent(list<CDirContent>& dirContent)
+{
+	if (g_profile == PROFILE_PORTABLE)
+		AdaptiveSort(dirContent, compare_portable);
+	else if (g_bNormalizeNames)
+		AdaptiveSort(dirContent, compare_normalized);
+	else
+		AdaptiveSort(dirContent, compare_nocase);
+}
+
+// Count the files and bytes that will be hashed, for the -prescan ETA
+DWORD PrescanTree(LPCTSTR szDirPath, list<wstring>& excludeSpecList)
+{
+	DWORD dwError;
+	list<CDirContent> dirContent;
+
+	if (lstrlen(szDirPath) <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szDirPath, excludeSpecList))
+		return 0;
+
+	dwError = ListDirectoryContent(szDirPath, dirContent, false);
+
+	// listing failures are reported during the hashing
+	if (dwError != ERROR_CANCELLED && dwError != ERROR_TIMEOUT)
+		dwError = 0;
+
+	for (list<CDirContent>::iterator it = dirContent.begin(); !dwError && it != dirContent.end(); it++)
+	{
+		if ((dwError = CheckCancellation()) != 0)
+			break;
+
+		if (it->IsDir())
+			dwError = PrescanTree(it->GetPath(), excludeSpecList);
+		else if (IsPrefetchCandidate(*it, excludeSpecList))
+		{
+			g_ullPrescanFiles++;
+			g_ullPrescanBytes += it->GetSize();
+		}
+	}
+	return dwError;
+}
+
+// ---------------------------------------------
+// With -threads (-sum only), the whole tree is enumerated first, then its
+// files are hashed by a pool of threads that take the largest files first
+// (LPT scheduling), so that a big file sorting last does not leave the other
+// threads idle at the end. Digests, errors and progress are reported by the
+// main thread in the original order as soon as all preceding files are done.
+
+static int g_iThreads = 0;
+
+// Records the bytes that HashName feeds, so that they can be hashed later by another thread
+class CByteCapture : public Hash
+{
+protected:
+	string m_data;
+public:
+	void Init() { m_data.clear();}
+	void Update(LPCBYTE pbData, size_t dwLength) { m_data.append((const char*) pbData, dwLength);}
+	void Final(LPBYTE pbDigest) {}
+	LPCTSTR GetID() { return _T("Capture");}
+	int GetHashSize() { return 0;}
+	const string& GetData() const { return m_data;}
+};
+
+struct CFileJob
+{
+	wstring szPath;
+	string nameData;
+	unsigned long long size;
+	wstring szDigest;
+	LPCTSTR szFailedPhase;
+	DWORD dwError;
+	volatile LONG lDone;
+};
+
+class CParallelHasher
+{
+protected:
+	vector<CFileJob> m_jobs;
+	vector<size_t> m_order;			// job indexes, largest first
+	volatile LONG m_lNextJob;
+	volatile LONG m_lStop;
+	volatile LONG m_lRunningThreads;
+	LPCTSTR m_szHashId;
+	HANDLE m_hDoneEvent;
+	CRITICAL_SECTION m_csProgress;
+	unsigned long long m_bytesHashed;
+	bool m_bIncludeNames;
+	bool m_bStripNames;
+
+	static bool CompareJobSize(const CFileJob* pFirst, const CFileJob* pSecond)
+	{
+		return pFirst->size > pSecond->size;
+	}
+
+	void HashJob(CFileJob& job, LPBYTE pbBuffer, DWORD cbBuffer)
+	{
+		BYTE pbJobDigest[128];
+		CFileReader* pReader;
+		Hash* pHash = Hash::GetHash(m_szHashId);
+
+		if (!job.nameData.empty())
+			pHash->Update((LPCBYTE) job.nameData.data(), job.nameData.length());
+
+		pReader = OpenFileForHashing(job.szPath.c_str(), job.dwError);
+		if (!pReader)
+			job.szFailedPhase = _T("open");
+		else
+		{
+			DWORD len;
+			while ((len = pReader->Read(pbBuffer, cbBuffer, job.dwError)) != 0)
+			{
+				pHash->Update(pbBuffer, len);
+
+				EnterCriticalSection(&m_csProgress);
+				m_bytesHashed += len;
+				LeaveCriticalSection(&m_csProgress);
+
+				if (m_lStop || (job.dwError = CheckCancellation()) != 0)
+					break;
+			}
+			if (job.dwError)
+				job.szFailedPhase = _T("read");
+			delete pReader;
+		}
+
+		if (!job.dwError)
+		{
+			pHash->Final(pbJobDigest);
+			if ((job.dwError = pHash->GetError()) != 0)
+				job.szFailedPhase = _T("hash");
+		}
+		if (!job.dwError)
+		{
+			job.szDigest.resize(DIGEST_ENCODED_MAX_CHARS(sizeof(pbJobDigest)));
+			job.szDigest.resize(DigestEncode(g_digestEncoding, pbJobDigest, pHash->GetHashSize(), &job.szDigest[0]));
+		}
+		delete pHash;
+	}
+
+	static DWORD WINAPI HashThread(LPVOID pParam)
+	{
+		CParallelHasher* pHasher = (CParallelHasher*) pParam;
+		LPBYTE pbBuffer = new BYTE[64 * 1024];
+		LONG lIndex;
+
+		// no new job is started once the run is cancelled or timed out
+		while (!pHasher->m_lStop && !CheckCancellation() && (lIndex = InterlockedIncrement(&pHasher->m_lNextJob) - 1) < (LONG) pHasher->m_order.size())
+		{
+			CFileJob& job = pHasher->m_jobs[pHasher->m_order[lIndex]];
+			pHasher->HashJob(job, pbBuffer, 64 * 1024);
+			if (job.dwError == ERROR_CANCELLED || job.dwError == ERROR_TIMEOUT)
+				InterlockedExchange(&pHasher->m_lStop, 1);
+			InterlockedExchange(&job.lDone, 1);
+			SetEvent(pHasher->m_hDoneEvent);
+		}
+
+		delete [] pbBuffer;
+		InterlockedDecrement(&pHasher->m_lRunningThreads);
+		SetEvent(pHasher->m_hDoneEvent);
+		return 0;
+	}
+
+public:
+	CParallelHasher(LPCTSTR szHashId, bool bIncludeNames, bool bStripNames)
+		: m_lNextJob(0), m_lStop(0), m_lRunningThreads(0), m_szHashId(szHashId), m_bytesHashed(0), m_bIncludeNames(bIncludeNames), m_bStripNames(bStripNames)
+	{
+		m_hDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		InitializeCriticalSection(&m_csProgress);
+	}
+
+	~CParallelHasher()
+	{
+		if (m_hDoneEvent) CloseHandle(m_hDoneEvent);
+		DeleteCriticalSection(&m_csProgress);
+	}
+
+	// same traversal as HashDirectory, recording the files instead of hashing them
+	DWORD Enumerate(LPCTSTR szDirPath, list<wstring>& excludeSpecList)
+	{
+		DWORD dwError;
+		list<CDirContent> dirContent;
+
+		if (lstrlen(szDirPath) <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szDirPath, excludeSpecList))
+			return 0;
+
+		dwError = ListDirectoryContent(szDirPath, dirContent);
+		if (dwError)
+			return dwError;
+
+		SortDirContent(dirContent);
+
+		for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
+		{
+			if ((dwError = CheckCancellation()) != 0)
+			{
+				ShowPartialReport (dwError, NULL);
+				return dwError;
+			}
+
+			if (!it->IsDir() && !IsPrefetchCandidate(*it, excludeSpecList))
+				continue;
+
+			size_t cchParentName = m_bIncludeNames? g_namePath.Push(it->GetName()) : 0;
+
+			if (it->IsDir())
+				dwError = Enumerate(it->GetPath(), excludeSpecList);
+			else
+			{
+				CFileJob job;
+				job.szPath = it->GetPath();
+				job.size = it->GetSize();
+				job.szFailedPhase = NULL;
+				job.dwError = 0;
+				job.lDone = 0;
+				if (m_bIncludeNames)
+				{
+					CByteCapture capture;
+					HashName (&capture, job.szPath.c_str(), m_bStripNames);
+					job.nameData = capture.GetData();
+				}
+				m_jobs.push_back(job);
+			}
+
+			if (m_bIncludeNames)
+				g_namePath.Pop(cchParentName);
+
+			if (dwError)
+				return dwError;
+		}
+		return 0;
+	}
+
+	DWORD Run(bool bQuiet, bool bShowProgress)
+	{
+		vector<HANDLE> threads;
+		vector<const CFileJob*> bySize;
+		unsigned long long totalBytes = 0;
+		DWORD dwError = 0, dwLastDisplay = 0;
+		size_t next = 0;
+
+		for (size_t i = 0; i < m_jobs.size(); i++)
+		{
+			bySize.push_back(&m_jobs[i]);
+			totalBytes += m_jobs[i].size;
+		}
+		// stable, so that files of equal size are started in their original order
+		stable_sort(bySize.begin(), bySize.end(), CompareJobSize);
+		for (size_t i = 0; i < bySize.size(); i++)
+			m_order.push_back(bySize[i] - &m_jobs[0]);
+
+		for (int i = 0; i < g_iThreads && i < (int) m_jobs.size(); i++)
+		{
+			InterlockedIncrement(&m_lRunningThreads);
+			HANDLE hThread = CreateThread(NULL, 0, HashThread, this, 0, NULL);
+			if (hThread)
+				threads.push_back(hThread);
+			else
+				InterlockedDecrement(&m_lRunningThreads);
+		}
+		if (threads.empty() && !m_jobs.empty())
+			return ERROR_NOT_ENOUGH_MEMORY;
+
+		while (next < m_jobs.size())
+		{
+			CFileJob& job = m_jobs[next];
+			if (!job.lDone)
+			{
+				// after a cancellation, the threads exit without taking the remaining jobs
+				if (!m_lRunningThreads && !job.lDone)
+				{
+					if (bShowProgress && !bQuiet && dwLastDisplay)
+					{
+						ClearProgress ();
+						dwLastDisplay = 0;
+					}
+					if ((dwError = CheckCancellation()) == 0)
+						dwError = ERROR_CANCELLED;
+					ShowPartialReport (dwError, NULL);
+					break;
+				}
+				WaitForSingleObject(m_hDoneEvent, 200);
+				if (bShowProgress && !bQuiet && (GetTickCount() - dwLastDisplay) >= 1000)
+				{
+					unsigned long long bytesHashed;
+					EnterCriticalSection(&m_csProgress);
+					bytesHashed = m_bytesHashed;
+					LeaveCriticalSection(&m_csProgress);
+
+					dwLastDisplay = GetTickCount();
+					_tprintf(_T("\r%I64u/%I64u file(s), %I64u/%I64u bytes"), (unsigned long long) next, (unsigned long long) m_jobs.size(), bytesHashed, totalBytes);
+					DisplayOverallProgress(bytesHashed, totalBytes);
+					_tprintf(_T("\r"));
+				}
+				continue;
+			}
+
+			if (bShowProgress && !bQuiet && dwLastDisplay)
+			{
+				ClearProgress ();
+				dwLastDisplay = 0;
+			}
+
+			if (job.dwError == ERROR_CANCELLED || job.dwError == ERROR_TIMEOUT)
+			{
+				dwError = job.dwError;
+				ShowPartialReport (dwError, job.szPath.c_str());
+				break;
+			}
+			else if (job.dwError)
+			{
+				if ((dwError = ReportFileError(job.szFailedPhase, job.szPath.c_str(), job.dwError)) != 0)
+					break;
+			}
+			else
+			{
+				EmitSumLine(job.szDigest.c_str(), job.szPath.c_str(), bQuiet);
+				g_ullFilesDone++;
+				g_ullBytesDone += job.size;
+				g_szLastFileDone = job.szPath;
+			}
+			next++;
+		}
+
+		if (bShowProgress && !bQuiet && dwLastDisplay)
 			ClearProgress ();
 
-		fclose(f);
+		InterlockedExchange(&m_lStop, 1);
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+		return dwError;
+	}
+};
+
+DWORD HashTreeParallel(LPCTSTR szDirPath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress)
+{
+	CParallelHasher hasher(pHash->GetID(), bIncludeNames, bStripNames);
+	DWORD dwError = hasher.Enumerate(szDirPath, excludeSpecList);
+
+	if (!dwError)
+		dwError = hasher.Run(bQuiet, bShowProgress);
+	return dwError;
+}
+
+DWORD HashDirectory(LPCTSTR szDirPath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress, bool bSumMode)
+{
+	DWORD dwError=0;
+	list<CDirContent> dirContent;
+	int pathLen = lstrlen(szDirPath);
+
+	if (pathLen <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szDirPath, excludeSpecList))
+		return 0;
+
+	if (bIncludeNames)
+		HashName (pHash, szDirPath, bStripNames);
+
+	dwError = ListDirectoryContent(szDirPath, dirContent);
+	if (dwError)
+		return dwError;
+
+	SortDirContent(dirContent);
+
+	list<CDirContent>::iterator itPrefetched = dirContent.begin();
+	for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
+	{
+		if ((dwError = CheckCancellation()) != 0)
+		{
+			ShowPartialReport (dwError, NULL);
+			break;
+		}
 
-		if (bSumMode)
+		if (g_bCacheFirst && bSumMode && !it->IsDir())
 		{
-			pHash->Final(pbDigest);
+			list<CDirContent>::iterator itRunEnd = it;
+			while (itRunEnd != dirContent.end() && !itRunEnd->IsDir())
+				itRunEnd++;
 
-			// display hash in yellow
-			SetConsoleTextAttribute (g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+			dwError = HashFilesCacheFirst(it, itRunEnd, pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress);
+			if (dwError || itRunEnd == dirContent.end())
+				break;
 
-			ToHex (pbDigest, pHash->GetHashSize(), szDigestHex);
+			it = itPrefetched = itRunEnd;
+		}
+
+		// queue the run of files that starts here, up to the next subdirectory
+		if (g_pPrefetcher && it == itPrefetched)
+		{
+			for (; itPrefetched != dirContent.end() && !itPrefetched->IsDir(); itPrefetched++)
+			{
+				if (IsPrefetchCandidate(*itPrefetched, excludeSpecList))
+					g_pPrefetcher->Enqueue(itPrefetched->GetPath());
+			}
+			if (itPrefetched == it)
+				itPrefetched++;
+		}
 
-			if (!bQuiet) _tprintf(_T("%s  %s\n"),szDigestHex, szFilePath);
-			if (outputFile) _ftprintf(outputFile, _T("%s  %s\n"),szDigestHex, szFilePath);
+		size_t cchParentName = bIncludeNames? g_namePath.Push(it->GetName()) : 0;
 
-			// restore normal text color
-			SetConsoleTextAttribute (g_hConsole, g_wAttributes);
+		if (it->IsDir())
+			dwError = HashDirectory( it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+		else
+		{
+			dwError = HashFile(it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+			if (g_pPrefetcher && IsPrefetchCandidate(*it, excludeSpecList))
+				g_pPrefetcher->Done();
+		}
+
+		if (bIncludeNames)
+			g_namePath.Pop(cchParentName);
+
+		if (dwError)
+			break;
+	}
+
+	return dwError;
+}
+
+// ---------------------------------------------
+// With -workers, the subdirectories of the input directory are hashed in -sum
+// mode by child DirHash processes, up to g_iWorkers at a time, while the files
+// at the top level are hashed by the coordinator. Each child is given the same
+// options plus "-worker name" so that it hashes only that subdirectory with
+// names derived from the same root, and writes its manifest to a temporary
+// file. Manifests are merged in traversal order, so the result is identical
+// to the one of a single process.
+
+static int g_iWorkers = 0;
+static wstring g_szWorkerArgs;
+
+void AppendQuotedArgument(wstring& szCommandLine, LPCTSTR szArg)
+{
+	size_t cchArg = _tcslen(szArg);
+
+	szCommandLine += _T(" \"");
+	for (size_t i = 0; i < cchArg; i++)
+	{
+		if (szArg[i] == _T('"'))
+			szCommandLine += _T('\\');
+		szCommandLine += szArg[i];
+	}
+	// backslashes before the closing quote must be doubled
+	for (size_t i = cchArg; i > 0 && szArg[i - 1] == _T('\\'); i--)
+		szCommandLine += _T('\\');
+	szCommandLine += _T('"');
+}
+
+// Options given to the children: everything except what concerns the output
+void SetWorkerArguments(int argc, _TCHAR* argv[])
+{
+	for (int i = 2; i < argc; i++)
+	{
+		if (	_tcscmp(argv[i], _T("-t")) == 0 || _tcscmp(argv[i], _T("-errors")) == 0
+			||	_tcscmp(argv[i], _T("-workers")) == 0 || _tcscmp(argv[i], _T("-worker")) == 0)
+		{
+			i++;
+		}
+		else if (	_tcscmp(argv[i], _T("-overwrite")) != 0 && _tcscmp(argv[i], _T("-clip")) != 0
+				&&	_tcscmp(argv[i], _T("-progress")) != 0 && _tcscmp(argv[i], _T("-quiet")) != 0
+				&&	_tcscmp(argv[i], _T("-nowait")) != 0
+				&&	_tcscmp(argv[i], _T("-calibrate")) != 0 && _tcscmp(argv[i], _T("-prescan")) != 0)
+		{
+			AppendQuotedArgument(g_szWorkerArgs, argv[i]);
+		}
+	}
+}
+
+struct CWorkerTask
+{
+	CDirContent* pEntry;
+	PROCESS_INFORMATION pi;
+	TCHAR szResultFile[MAX_PATH];
+	TCHAR szErrorFile[MAX_PATH];
+	bool bStarted;
+};
+
+bool StartWorker(LPCTSTR szRootPath, CWorkerTask& task)
+{
+	TCHAR szModule[MAX_PATH], szTempDir[MAX_PATH];
+	STARTUPINFO si;
+	wstring szCommandLine;
+
+	task.bStarted = false;
+	if (	!GetModuleFileName(NULL, szModule, ARRAYSIZE(szModule))
+		||	!GetTempPath(ARRAYSIZE(szTempDir), szTempDir)
+		||	!GetTempFileName(szTempDir, _T("dhw"), 0, task.szResultFile))
+		return false;
+
+	task.szErrorFile[0] = 0;
+	if (g_bContinueOnError && !GetTempFileName(szTempDir, _T("dhe"), 0, task.szErrorFile))
+	{
+		DeleteFile(task.szResultFile);
+		return false;
+	}
+
+	AppendQuotedArgument(szCommandLine, szModule);
+	AppendQuotedArgument(szCommandLine, szRootPath);
+	szCommandLine += g_szWorkerArgs;
+	szCommandLine += _T(" -quiet -nowait -overwrite -t");
+	AppendQuotedArgument(szCommandLine, task.szResultFile);
+	if (task.szErrorFile[0])
+	{
+		szCommandLine += _T(" -errors");
+		AppendQuotedArgument(szCommandLine, task.szErrorFile);
+	}
+	szCommandLine += _T(" -worker");
+	AppendQuotedArgument(szCommandLine, task.pEntry->GetPath() + _tcslen(task.pEntry->GetPath()) - _tcslen(task.pEntry->GetName()));
+
+	ZeroMemory(&si, sizeof(si));
+	si.cb = sizeof(si);
+	if (!CreateProcess(szModule, &szCommandLine[1], NULL, NULL, FALSE, 0, NULL, NULL, &si, &task.pi))
+	{
+		DeleteFile(task.szResultFile);
+		if (task.szErrorFile[0])
+			DeleteFile(task.szErrorFile);
+		return false;
+	}
+
+	CloseHandle(task.pi.hThread);
+	task.bStarted = true;
+	return true;
+}
+
+void DiscardWorker(CWorkerTask& task)
+{
+	if (!task.bStarted)
+		return;
+
+	TerminateProcess(task.pi.hProcess, ERROR_CANCELLED);
+	WaitForSingleObject(task.pi.hProcess, INFINITE);
+	CloseHandle(task.pi.hProcess);
+	DeleteFile(task.szResultFile);
+	if (task.szErrorFile[0])
+		DeleteFile(task.szErrorFile);
+	task.bStarted = false;
+}
+
+// Wait for a child and merge its manifest and error manifest into ours
+DWORD CollectWorker(CWorkerTask& task, bool bQuiet)
+{
+	DWORD dwError = 0, dwExitCode = 0;
+	TCHAR szLine[4096];
+	FILE* f;
+
+	while (WaitForSingleObject(task.pi.hProcess, 200) == WAIT_TIMEOUT)
+	{
+		if ((dwError = CheckCancellation()) != 0)
+		{
+			DiscardWorker(task);
+			return dwError;
+		}
+	}
+
+	GetExitCodeProcess(task.pi.hProcess, &dwExitCode);
+	CloseHandle(task.pi.hProcess);
+	task.bStarted = false;
+
+	// a partial result is only possible with -continue; any other failure
+	// means the manifest of the child is incomplete and must not be merged
+	if (dwExitCode != 0 && !(g_bContinueOnError && dwExitCode == DIRHASH_EXIT_PARTIAL))
+	{
+		ShowError(_T("Worker for \"%s\" failed with exit code 0x%.8X\n"), task.pEntry->GetPath(), dwExitCode);
+		DeleteFile(task.szResultFile);
+		if (task.szErrorFile[0])
+			DeleteFile(task.szErrorFile);
+		return dwExitCode;
+	}
+
+	if ((f = _tfopen(task.szResultFile, _T("rt"))) != NULL)
+	{
+		// display hashes in yellow, as HashFile does
+		SetConsoleTextAttribute (g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+		while (_fgetts(szLine, ARRAYSIZE(szLine), f))
+		{
+			if (!bQuiet) _tprintf(_T("%s"), szLine);
+			if (outputFile) OutputPrintf(_T("%s"), szLine);
 		}
+		SetConsoleTextAttribute (g_hConsole, g_wAttributes);
+		fclose(f);
 	}
-	else
+	DeleteFile(task.szResultFile);
+
+	if (task.szErrorFile[0])
 	{
-		_tprintf(TEXT("Failed to open file \"%s\" for reading\n"), szFilePath);
-		dwError = -1;
+		if ((f = _tfopen(task.szErrorFile, _T("rt"))) != NULL)
+		{
+			while (_fgetts(szLine, ARRAYSIZE(szLine), f))
+			{
+				g_ullErrorCount++;
+				if (g_errorFile) _ftprintf(g_errorFile, _T("%s"), szLine);
+			}
+			fclose(f);
+		}
+		DeleteFile(task.szErrorFile);
 	}
-
-	if (bSumMode)
-		delete pHash;
 	return dwError;
 }
 
-DWORD HashDirectory(LPCTSTR szDirPath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress, bool bSumMode)
+DWORD HashTree(LPCTSTR szDirPath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress, bool bSumMode)
 {
-	wstring szDir;
-	WIN32_FIND_DATA ffd;
-	HANDLE hFind = INVALID_HANDLE_VALUE;
-	DWORD dwError=0;
+	if (g_iThreads > 1 && bSumMode)
+		return HashTreeParallel(szDirPath, pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress);
+	return HashDirectory(szDirPath, pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+}
+
+DWORD HashDirectoryWithWorkers(LPCTSTR szDirPath, Hash* pHash, bool bIncludeNames, bool bStripNames, list<wstring>& excludeSpecList, bool bQuiet, bool bShowProgress)
+{
+	DWORD dwError = 0;
 	list<CDirContent> dirContent;
-	int pathLen = lstrlen(szDirPath);
+	vector<CWorkerTask> tasks;
+	size_t nextTask = 0, currentTask = 0;
+	int iRunning = 0;
 
-	if (pathLen <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szDirPath, excludeSpecList))
+	if (lstrlen(szDirPath) <= MAX_PATH && !excludeSpecList.empty() && IsExcludedName (szDirPath, excludeSpecList))
 		return 0;
 
-	if (bIncludeNames)
+	if ((dwError = ListDirectoryContent(szDirPath, dirContent)) != 0)
+		return dwError;
+
+	SortDirContent(dirContent);
+
+	for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
 	{
-		LPCTSTR pNameToHash = NULL;
-		if (lstrlen(szDirPath) > MAX_PATH)
-			pNameToHash = szDirPath;
-		else
+		if (it->IsDir())
+		{
+			CWorkerTask task;
+			task.pEntry = &(*it);
+			task.bStarted = false;
+			tasks.push_back(task);
+		}
+	}
+
+	for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
+	{
+		// keep the children busy ahead of the merge position
+		for (; nextTask < tasks.size() && iRunning < g_iWorkers; nextTask++)
+		{
+			if (StartWorker(szDirPath, tasks[nextTask]))
+				iRunning++;
+		}
+
+		if ((dwError = CheckCancellation()) != 0)
 		{
-			g_szCanonalizedName[MAX_PATH] = 0;
-			if (!PathCanonicalize (g_szCanonalizedName, szDirPath))
-				lstrcpy (g_szCanonalizedName, szDirPath);
+			ShowPartialReport (dwError, NULL);
+			break;
+		}
+
+		size_t cchParentName = bIncludeNames? g_namePath.Push(it->GetName()) : 0;
 
-			if (bStripNames)
-				pNameToHash = PathFindFileName(g_szCanonalizedName);
+		if (!it->IsDir())
+			dwError = HashFile(it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, true);
+		else
+		{
+			CWorkerTask& task = tasks[currentTask++];
+			if (task.bStarted)
+			{
+				iRunning--;
+				dwError = CollectWorker(task, bQuiet);
+				if (dwError == ERROR_CANCELLED || dwError == ERROR_TIMEOUT)
+					ShowPartialReport (dwError, it->GetPath());
+			}
 			else
-				pNameToHash = g_szCanonalizedName;         
+			{
+				// the child could not be started: hash the subdirectory here
+				dwError = HashDirectory(it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, true);
+			}
 		}
 
-		pHash->Update ((LPCBYTE) pNameToHash, _tcslen (pNameToHash) * sizeof(TCHAR));
+		if (bIncludeNames)
+			g_namePath.Pop(cchParentName);
+
+		if (dwError)
+			break;
 	}
 
-	szDir += szDirPath;
-	szDir += _T("\\*");
+	for (size_t i = currentTask; i < tasks.size(); i++)
+		DiscardWorker(tasks[i]);
 
-	// Find the first file in the directory.
+	return dwError;
+}
 
-	hFind = FindFirstFile(szDir.c_str(), &ffd);
+// ---------------------------------------------
+// -selftest: known answer tests of the code specific to DirHash. Each check
+// prints its result; the number of failures is returned.
 
-	if (INVALID_HANDLE_VALUE == hFind) 
-	{
-		dwError = GetLastError();
-		_tprintf(TEXT("FindFirstFile failed on \"%s\" with error 0x%.8X.\n"), szDirPath, dwError);
-		return dwError;
-	} 
+static int g_iSelfTestFailures = 0;
 
-	// List all the files in the directory with some info about them.
+void SelfTestCheck(LPCTSTR szTest, bool bPassed)
+{
+	_tprintf(_T("%s: %s\n"), bPassed? _T("passed") : _T("FAILED"), szTest);
+	if (!bPassed)
+		g_iSelfTestFailures++;
+}
 
-	do
+// Sort the names listed in both directions and compare with the expected order
+void SelfTestSort(LPCTSTR szTest, DigestProfile profile, bool bNormalize, LPCWSTR names[], LPCWSTR expected[], int count)
+{
+	DigestProfile savedProfile = g_profile;
+	bool bSavedNormalize = g_bNormalizeNames;
+	bool bPassed = true;
+
+	g_profile = profile;
+	g_bNormalizeNames = bNormalize;
+	for (int pass = 0; pass < 2; pass++)
 	{
-		if (  (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-		{
-			// Skip "." and ".." directories
-			if ( (_tcscmp(ffd.cFileName, _T(".")) != 0) && (_tcscmp(ffd.cFileName, _T("..")) != 0))
-				dirContent.push_back(CDirContent(szDirPath, ffd.cFileName, true));
-		}
-		else
-		{
-			dirContent.push_back(CDirContent(szDirPath, ffd.cFileName, false));
-		}
+		list<CDirContent> dirContent;
+		int i = 0;
+		for (i = 0; i < count; i++)
+			dirContent.push_back(CDirContent(L"C:\\", names[pass? count - 1 - i : i], false));
+		SortDirContent(dirContent);
+		i = 0;
+		for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++, i++)
+			bPassed = bPassed && (wcscmp(it->GetName(), expected[i]) == 0);
 	}
-	while (FindNextFile(hFind, &ffd) != 0);
+	g_profile = savedProfile;
+	g_bNormalizeNames = bSavedNormalize;
 
-	dwError = GetLastError();
-	if (dwError != ERROR_NO_MORE_FILES) 
+	SelfTestCheck(szTest, bPassed);
+}
+
+void SelfTestNameOrder()
+{
+	LPCWSTR caseNames[] = { L"b", L"A", L"B", L"a" };
+	LPCWSTR caseExpected[] = { L"A", L"a", L"B", L"b" };
+	// U+00E9 composed, and e followed by U+0301: the same name once normalized
+	LPCWSTR formNames[] = { L"\x00E9", L"f", L"e\x0301", L"E\x0301" };
+	LPCWSTR formExpected[] = { L"f", L"E\x0301", L"e\x0301", L"\x00E9" };
+
+	SelfTestSort(_T("-normalize order of names differing by case"), PROFILE_WINDOWS, true, caseNames, caseExpected, ARRAYSIZE(caseNames));
+	SelfTestSort(_T("portable order of names differing by case"), PROFILE_PORTABLE, false, caseNames, caseExpected, ARRAYSIZE(caseNames));
+	if (!LoadNormalization())
+		_tprintf(_T("skipped: order of names differing by composition (Normaliz.dll not available)\n"));
+	else
 	{
-		_tprintf(TEXT("FindNextFile failed while listing \"%s\". \n Error 0x%.8X.\n"), szDirPath, GetLastError());
-		return dwError;
+		SelfTestSort(_T("-normalize order of names differing by composition"), PROFILE_WINDOWS, true, formNames, formExpected, ARRAYSIZE(formNames));
+		SelfTestSort(_T("portable order of names differing by composition"), PROFILE_PORTABLE, false, formNames, formExpected, ARRAYSIZE(formNames));
 	}
+}
 
-	// Clear the error
-	dwError = 0;
+// Hash the message cbStep bytes at a time (at once when cbStep is 0) and compare with the expected hexadecimal digest
+void SelfTestDigest(LPCTSTR szTest, Hash* pHash, const vector<BYTE>& message, size_t cbStep, LPCWSTR szExpected)
+{
+	BYTE pbTestDigest[64];
+	WCHAR szTestDigest[2 * sizeof(pbTestDigest) + 1];
 
-	FindClose(hFind);
+	pHash->Init();
+	if (!cbStep)
+		pHash->Update(message.empty()? NULL : &message[0], message.size());
+	else
+	{
+		for (size_t i = 0; i < message.size(); i += cbStep)
+			pHash->Update(&message[i], min(cbStep, message.size() - i));
+	}
+	pHash->Final(pbTestDigest);
+	DigestToHex(pbTestDigest, pHash->GetHashSize(), szTestDigest, 0);
 
-	// Sort all entries
-	dirContent.sort(compare_nocase);
+	SelfTestCheck(szTest, wcscmp(szTestDigest, szExpected) == 0);
+}
 
-	for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
+// KT128 vectors of RFC 9861 section 5, with an empty customization string.
+// ptn(n) is the byte pattern 00 01 .. FA repeated up to n bytes.
+void SelfTestKangarooTwelve()
+{
+	static const struct
 	{
-		if (it->IsDir())
-		{
-			dwError = HashDirectory( it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
-			if (dwError)
-				break;
-		}
-		else
-		{
-			dwError = HashFile(it->GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
-			if (dwError)
-				break;
-		}
+		LPCTSTR szTest;
+		size_t cbMessage;
+		LPCWSTR szDigest;
+	} vectors[] =
+	{
+		{ _T("K12 of the empty message"), 0, L"1AC2D450FC3B4205D19DA7BFCA1B37513C0803577AC7167F06FE2CE1F0EF39E5" },
+		{ _T("K12 of ptn(17^3)"), 17 * 17 * 17, L"CB552E2EC77D9910701D578B457DDF772C12E322E4EE7FE417F92C758F0D59D0" },
+		{ _T("K12 of ptn(17^4)"), 17 * 17 * 17 * 17, L"8701045E22205345FF4DDA05555CBB5C3AF1A771C2B89BAEF37DB43D9998B9FE" },
+	};
+	KangarooTwelve k12;
+
+	for (size_t i = 0; i < ARRAYSIZE(vectors); i++)
+	{
+		vector<BYTE> message(vectors[i].cbMessage);
+		for (size_t j = 0; j < message.size(); j++)
+			message[j] = (BYTE) (j % 251);
+
+		SelfTestDigest(vectors[i].szTest, &k12, message, 0, vectors[i].szDigest);
+		if (!message.empty())
+			SelfTestDigest((wstring(vectors[i].szTest) + _T(", byte by byte")).c_str(), &k12, message, 1, vectors[i].szDigest);
 	}
+}
 
-	return dwError;
+// Check values of the CRC catalogue for "123456789", then a message long
+// enough for the SSE4.2 strides and the PCLMULQDQ folding, at once and split
+// so that the streams restart at unaligned positions.
+void SelfTestCrc()
+{
+	const char szCheck[] = "123456789";
+	vector<BYTE> check(szCheck, szCheck + 9), message(100000);
+	Crc32c crc32c;
+	Crc64 crc64;
+
+	for (size_t i = 0; i < message.size(); i++)
+		message[i] = (BYTE) (i % 251);
+
+	SelfTestDigest(_T("CRC32C check value"), &crc32c, check, 0, L"E3069283");
+	SelfTestDigest(_T("CRC64 check value"), &crc64, check, 0, L"995DC9BBDF1939FA");
+	SelfTestDigest(_T("CRC32C of 100000 bytes"), &crc32c, message, 0, L"7247F66B");
+	SelfTestDigest(_T("CRC32C of 100000 bytes, 4093 bytes at a time"), &crc32c, message, 4093, L"7247F66B");
+	SelfTestDigest(_T("CRC32C of 100000 bytes, byte by byte"), &crc32c, message, 1, L"7247F66B");
+	SelfTestDigest(_T("CRC64 of 100000 bytes"), &crc64, message, 0, L"693C6C5349A22AC9");
+	SelfTestDigest(_T("CRC64 of 100000 bytes, 4093 bytes at a time"), &crc64, message, 4093, L"693C6C5349A22AC9");
+	SelfTestDigest(_T("CRC64 of 100000 bytes, byte by byte"), &crc64, message, 1, L"693C6C5349A22AC9");
+}
+
+int RunSelfTests()
+{
+	g_iSelfTestFailures = 0;
+	SelfTestNameOrder();
+	SelfTestKangarooTwelve();
+	SelfTestCrc();
+	return g_iSelfTestFailures;
 }
 
 void ShowLogo()
 {
 	SetConsoleTextAttribute (g_hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-	_tprintf(_T("\nDirHash by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2019\n\nRecursively compute hash of a given directory content in lexicographical order.\nIt can also compute the hash of a single file.\n\nSupported Algorithms : MD5, SHA1, SHA256, SHA384, SHA512 and Streebog\nUsing OpenSSL\n\n"));
+	_tprintf(_T("\nDirHash by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2019\n\nRecursively compute hash of a given directory content in lexicographical order.\nIt can also compute the hash of a single file.\n\nSupported Algorithms : MD5, SHA1, SHA256, SHA384, SHA512, SHA512_256, SHA512_224, K12, Streebog, CRC32C and CRC64\nUsing OpenSSL\n\n"));
 	SetConsoleTextAttribute (g_hConsole, g_wAttributes);
 }
 
 void ShowUsage()
 {
 	ShowLogo();
-	_tprintf(TEXT("Usage: DirHash.exe DirectoryOrFilePath [HashAlgo] [-t ResultFileName] [-sum] [-clip] [-overwrite]  [-quiet] [-nowait] [-hashnames] [-exclude pattern1] [-exclude pattern2]\n\n  Possible values for HashAlgo (not case sensitive, default is SHA1):\n  MD5, SHA1, SHA256, SHA384, SHA512 and Streebog\n\n  ResultFileName: text file where the result will be appended\n\n  -sum: output hash of every file processed in a format similar to shasum.\n\n  -clip: copy the result to Windows clipboard (ignored when -sum specified)\n\n  -progress: Display information about the progress of hash operation\n\n  -overwrite (only when -t present): output text file will be overwritten\n\n  -quiet: No text is displayed or written except the hash value\n\n  -nowait: avoid displaying the waiting prompt before exiting\n\n  -hashnames: file names will be included in hash computation\n\n  -exclude specifies a name pattern for files to exclude from hash computation.\n\n"));
-}
-
-void ShowError(LPCTSTR szMsg, ...)
-{
-	va_list args;
-	va_start( args, szMsg );
-	SetConsoleTextAttribute (g_hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
-	_vtprintf (szMsg, args );
-	SetConsoleTextAttribute (g_hConsole, g_wAttributes);
-	va_end( args );
+	_tprintf(TEXT("Usage: DirHash.exe DirectoryOrFilePath [HashAlgo] [-t ResultFileName] [-sum] [-encoding hex|hexlower|base64|base32] [-clip] [-overwrite]  [-quiet] [-nowait] [-hashnames [-stripnames] [-normalize]] [-profile windows|portable] [-priority level] [-timeout seconds] [-continue] [-errors ErrorFileName] [-retry count] [-iotimeout seconds] [-connections count] [-workers count] [-prefetch count] [-cachefirst] [-threads count] [-prescan] [-pipeline blocks] [-queuedepth reads] [-minsize bytes] [-maxsize bytes] [-newer date] [-older date] [-gitignore] [-backend builtin|cng|auto] [-calibrate] [-exclude pattern1] [-exclude pattern2]\n       DirHash.exe -selftest\n\n  Possible values for HashAlgo (not case sensitive, default is SHA1):\n  MD5, SHA1, SHA256, SHA384, SHA512, SHA512_256, SHA512_224, K12, Streebog, CRC32C and CRC64\n\n  ResultFileName: text file where the result will be appended\n\n  -sum: output hash of every file processed in a format similar to shasum.\n\n  -encoding: text encoding of hash values, hex (upper case, default), hexlower, base64 or base32\n\n  -clip: copy the result to Windows clipboard (ignored when -sum specified)\n\n  -progress: Display information about the progress of hash operation\n\n  -overwrite (only when -t present): output text file will be overwritten\n\n  -quiet: No text is displayed or written except the hash value\n\n  -nowait: avoid displaying the waiting prompt before exiting\n\n  -hashnames: file names will be included in hash computation\n\n  -normalize (only when -hashnames present): names are converted to Unicode NFC and ASCII lower case and hashed as UTF-8\n\n  -profile: digest profile, windows (default) or portable (UTF-8 names relative to the input with '/' separators, code point order)\n\n  -priority: CPU and I/O priority of the run: background, low, normal (default) or high\n\n  -timeout: stop after the given number of seconds and report what was completed\n\n  -continue: record I/O errors and keep going instead of stopping; the result is then marked as partial\n\n  -errors (implies -continue): text file where failures are written as phase, error code and path\n\n  -retry: number of retries, with increasing delay, of operations failing with a transient error\n\n  -iotimeout: maximum duration in seconds of a single file open or read before it is abandoned\n\n  -connections: number of parallel ranged requests per object when the input is an S3-compatible URL (default 4)\n\n  -workers (only with -sum): number of child processes hashing the subdirectories of the input directory in parallel\n\n  -prefetch: number of upcoming files read ahead into the system cache while the current one is hashed\n\n  -cachefirst (only with -sum): hash files already in the system cache before the others, keeping the output order\n\n  -threads (only with -sum): number of threads hashing files in parallel, largest files first, with results in the usual order\n\n  -prescan: total the sizes of all files before hashing in order to display an overall ETA with -progress\n\n  -pipeline: number of 256 KB blocks read ahead by a reader thread while the main thread hashes\n\n  -queuedepth: number of 256 KB overlapped reads kept in flight for each file\n\n  -minsize, -maxsize: only hash files of at least/at most the given size in bytes (K, M, G or T suffix allowed)\n\n  -newer, -older: only hash files last modified at or after/before the given UTC date (YYYY-MM-DD[Thh:mm:ss])\n\n  -gitignore: skip the files and directories ignored by .gitignore and .ignore files, as well as .git directories\n\n  -backend: builtin (default), cng to compute MD5 and SHA hashes with Windows CNG providers, or auto for the fastest one on this machine\n\n  -calibrate (implies -backend auto): measure the implementations again instead of using the saved choice\n\n  -exclude specifies a name pattern for files to exclude from hash computation.\n\n"));
 }
 
 void WaitForExit(bool bDontWait = false)
@@ -576,6 +4942,33 @@ void CopyToClipboard (LPCTSTR szDigestHex)
 	}
 }
 
+#ifndef PROCESS_MODE_BACKGROUND_BEGIN
+#define PROCESS_MODE_BACKGROUND_BEGIN 0x00100000
+#endif
+
+// Set the CPU and I/O priority of the whole run so that a bulk scan can share
+// the machine with interactive runs: Windows schedules the CPU and the disk
+// queues of all running DirHash instances according to these classes.
+bool SetRunPriority(LPCTSTR szPriority)
+{
+	HANDLE hProcess = GetCurrentProcess();
+
+	if (_tcsicmp(szPriority, _T("background")) == 0)
+	{
+		// lowers CPU, I/O and memory priority (Vista and later)
+		if (SetPriorityClass(hProcess, PROCESS_MODE_BACKGROUND_BEGIN))
+			return true;
+		return SetPriorityClass(hProcess, IDLE_PRIORITY_CLASS) != FALSE;
+	}
+	if (_tcsicmp(szPriority, _T("low")) == 0)
+		return SetPriorityClass(hProcess, BELOW_NORMAL_PRIORITY_CLASS) != FALSE;
+	if (_tcsicmp(szPriority, _T("normal")) == 0)
+		return SetPriorityClass(hProcess, NORMAL_PRIORITY_CLASS) != FALSE;
+	if (_tcsicmp(szPriority, _T("high")) == 0)
+		return SetPriorityClass(hProcess, ABOVE_NORMAL_PRIORITY_CLASS) != FALSE;
+	return false;
+}
+
 int _tmain(int argc, _TCHAR* argv[])
 {
 	size_t length_of_arg;
@@ -583,6 +4976,7 @@ int _tmain(int argc, _TCHAR* argv[])
 	DWORD dwError=0;
 	Hash* pHash = NULL;
 	wstring outputFileName;
+	wstring errorFileName;
 	bool bDontWait = false;
 	bool bIncludeNames = false;
 	bool bStripNames = false;
@@ -591,96 +4985,433 @@ int _tmain(int argc, _TCHAR* argv[])
 	bool bCopyToClipboard = false;
 	bool bShowProgress = false;
 	bool bSumMode = false; 
+	bool bPrescan = false;
+	bool bCalibrate = false;
 	list<wstring> excludeSpecList;
+	LPCTSTR szWorkerSubdir = NULL;
 	g_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);   
 
 	// get original console attributes
 	if (GetConsoleScreenBufferInfo(g_hConsole, &g_originalConsoleInfo))
 		g_wAttributes = g_originalConsoleInfo.wAttributes;
 
-	setbuf (stdout, NULL);
+	setbuf (stdout, NULL);
+
+	// selects the SIMD implementations of Streebog and of the CRCs; OpenSSL does its own detection for the SHA family
+	DetectX86Features();
+	Crc_init();
+
+	SetConsoleTitle(_T("DirHash by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2018"));
+
+	if (argc < 2)
+	{
+		ShowUsage();
+		WaitForExit();
+		return 1;
+	}
+
+	if (_tcscmp(argv[1], _T("-selftest")) == 0)
+	{
+		int iFailures = RunSelfTests();
+		if (iFailures)
+			ShowError(_T("%d self test(s) failed\n"), iFailures);
+		return iFailures? 1 : 0;
+	}
+
+	if (argc >= 3)
+	{
+		for (int i = 2; i < argc; i++)
+		{
+			if (_tcscmp(argv[i],_T("-t")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument               
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -t\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				outputFileName = argv[i + 1];
+
+				i++;
+			}
+			else if (_tcscmp(argv[i],_T("-overwrite")) == 0)
+			{
+				bOverwrite = true;
+			}
+			else if (_tcscmp(argv[i],_T("-nowait")) == 0)
+			{
+				bDontWait = true;
+			}
+			else if (_tcscmp(argv[i],_T("-quiet")) == 0)
+			{
+				bQuiet = true;
+			}
+			else if (_tcscmp(argv[i],_T("-hashnames")) == 0)
+			{
+				bIncludeNames = true;
+			}
+			else if (_tcscmp(argv[i],_T("-stripnames")) == 0)
+			{
+				bStripNames = true;
+			}
+			else if (_tcscmp(argv[i],_T("-normalize")) == 0)
+			{
+				if (!LoadNormalization())
+				{
+					ShowError(_T("Error: Unicode normalization is not supported on this system (Normaliz.dll is missing)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+				g_bNormalizeNames = true;
+			}
+			else if (_tcscmp(argv[i],_T("-profile")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing profile argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -profile\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i + 1], _T("windows")) == 0)
+					g_profile = PROFILE_WINDOWS;
+				else if (_tcsicmp(argv[i + 1], _T("portable")) == 0)
+				{
+					if (!LoadNormalization())
+					{
+						ShowError(_T("Error: Unicode normalization is not supported on this system (Normaliz.dll is missing)\n"));
+						WaitForExit(bDontWait);
+						return 1;
+					}
+					g_profile = PROFILE_PORTABLE;
+				}
+				else
+				{
+					ShowUsage();
+					ShowError(_T("Error: Unknown profile \"%s\"\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				i++;
+			}
+			else if (_tcscmp(argv[i],_T("-encoding")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing encoding argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -encoding\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i + 1], _T("hex")) == 0)
+					g_digestEncoding = DIGEST_ENCODING_HEX_UPPER;
+				else if (_tcsicmp(argv[i + 1], _T("hexlower")) == 0)
+					g_digestEncoding = DIGEST_ENCODING_HEX_LOWER;
+				else if (_tcsicmp(argv[i + 1], _T("base64")) == 0)
+					g_digestEncoding = DIGEST_ENCODING_BASE64;
+				else if (_tcsicmp(argv[i + 1], _T("base32")) == 0)
+					g_digestEncoding = DIGEST_ENCODING_BASE32;
+				else
+				{
+					ShowUsage();
+					ShowError(_T("Error: Unknown encoding \"%s\"\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				i++;
+			}
+			else if (_tcscmp(argv[i],_T("-sum")) == 0)
+			{
+				bSumMode = true;
+			}
+			else if (_tcscmp(argv[i],_T("-exclude")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument               
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -exclude\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				excludeSpecList.push_back(argv[i+1]);
+
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-clip")) == 0)
+			{
+				bCopyToClipboard = true;
+			}
+			else if (_tcscmp(argv[i], _T("-progress")) == 0)
+			{
+				bShowProgress = true;
+			}
+			else if (_tcscmp(argv[i], _T("-continue")) == 0)
+			{
+				g_bContinueOnError = true;
+			}
+			else if (_tcscmp(argv[i], _T("-errors")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -errors\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				errorFileName = argv[i + 1];
+				g_bContinueOnError = true;
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-retry")) == 0)
+			{
+				if ((i + 1) >= argc || !_istdigit(argv[i + 1][0]))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid count for switch -retry\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
-	SetConsoleTitle(_T("DirHash by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2018"));
+				g_iMaxRetries = (int) min(_tcstoul(argv[i + 1], NULL, 10), 16UL);
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-iotimeout")) == 0)
+			{
+				unsigned long seconds = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (seconds == 0 || seconds > (0xFFFFFFFF / 1000))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid number of seconds for switch -iotimeout\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
-	if (argc < 2)
-	{
-		ShowUsage();
-		WaitForExit();
-		return 1;
-	}
+				g_dwIoTimeout = (DWORD) seconds * 1000;
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-workers")) == 0)
+			{
+				unsigned long workers = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (workers < 2 || workers > 64)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid count for switch -workers (2 to 64)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
-	if (argc >= 3)
-	{
-		for (int i = 2; i < argc; i++)
-		{
-			if (_tcscmp(argv[i],_T("-t")) == 0)
+				g_iWorkers = (int) workers;
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-worker")) == 0)
 			{
+				// internal: hash a single subdirectory of the input on behalf of a coordinator
 				if ((i + 1) >= argc)
 				{
-					// missing file argument               
 					ShowUsage();
-					ShowError(_T("Error: Missing argument for switch -t\n"));
+					ShowError(_T("Error: Missing argument for switch -worker\n"));
 					WaitForExit(bDontWait);
 					return 1;
 				}
 
-				outputFileName = argv[i + 1];
+				szWorkerSubdir = argv[i + 1];
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-threads")) == 0)
+			{
+				unsigned long threads = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (threads == 0 || threads > 256)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid count for switch -threads (1 to 256)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
+				g_iThreads = (int) threads;
 				i++;
 			}
-			else if (_tcscmp(argv[i],_T("-overwrite")) == 0)
+			else if (_tcscmp(argv[i], _T("-prescan")) == 0)
 			{
-				bOverwrite = true;
+				bPrescan = true;
 			}
-			else if (_tcscmp(argv[i],_T("-nowait")) == 0)
+			else if (_tcscmp(argv[i], _T("-queuedepth")) == 0)
 			{
-				bDontWait = true;
+				unsigned long depth = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (depth < 2 || depth > 256)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid number of reads for switch -queuedepth (2 to 256)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_iQueueDepth = (int) depth;
+				i++;
 			}
-			else if (_tcscmp(argv[i],_T("-quiet")) == 0)
+			else if (_tcscmp(argv[i], _T("-pipeline")) == 0)
 			{
-				bQuiet = true;
+				unsigned long depth = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (depth < 2 || depth > 256)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid number of blocks for switch -pipeline (2 to 256)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_iPipelineDepth = (int) depth;
+				i++;
 			}
-			else if (_tcscmp(argv[i],_T("-hashnames")) == 0)
+			else if (_tcscmp(argv[i], _T("-cachefirst")) == 0)
 			{
-				bIncludeNames = true;
+				g_bCacheFirst = true;
 			}
-			else if (_tcscmp(argv[i],_T("-stripnames")) == 0)
+			else if (_tcscmp(argv[i], _T("-minsize")) == 0 || _tcscmp(argv[i], _T("-maxsize")) == 0)
 			{
-				bStripNames = true;
+				bool bMin = (argv[i][2] == _T('i'));
+				if (((i + 1) >= argc) || !ParseSize(argv[i + 1], bMin? g_ullMinSize : g_ullMaxSize))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid size for switch %s (bytes, with optional K, M, G or T suffix)\n"), argv[i]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_bFilterFiles = true;
+				i++;
 			}
-			else if (_tcscmp(argv[i],_T("-sum")) == 0)
+			else if (_tcscmp(argv[i], _T("-newer")) == 0 || _tcscmp(argv[i], _T("-older")) == 0)
 			{
-				bSumMode = true;
+				bool bNewer = (argv[i][1] == _T('n'));
+				if (((i + 1) >= argc) || !ParseUtcTime(argv[i + 1], bNewer? g_ullNewerThan : g_ullOlderThan))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid UTC date for switch %s (YYYY-MM-DD or YYYY-MM-DDThh:mm:ss)\n"), argv[i]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_bFilterFiles = true;
+				i++;
 			}
-			else if (_tcscmp(argv[i],_T("-exclude")) == 0)
+			else if (_tcscmp(argv[i], _T("-gitignore")) == 0)
 			{
-				if ((i + 1) >= argc)
+				g_bGitIgnore = true;
+				g_bFilterFiles = true;
+			}
+			else if (_tcscmp(argv[i], _T("-prefetch")) == 0)
+			{
+				unsigned long files = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (files == 0 || files > 1024)
 				{
-					// missing file argument               
 					ShowUsage();
-					ShowError(_T("Error: Missing argument for switch -exclude\n"));
+					ShowError(_T("Error: Missing or invalid count for switch -prefetch (1 to 1024)\n"));
 					WaitForExit(bDontWait);
 					return 1;
 				}
 
-				excludeSpecList.push_back(argv[i+1]);
+				g_iPrefetchFiles = (int) files;
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-connections")) == 0)
+			{
+				unsigned long connections = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (connections == 0 || connections > 64)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid count for switch -connections (1 to 64)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
+				g_iHttpConnections = (int) connections;
 				i++;
 			}
-			else if (_tcscmp(argv[i], _T("-clip")) == 0)
+			else if (_tcscmp(argv[i], _T("-timeout")) == 0)
 			{
-				bCopyToClipboard = true;
+				unsigned long seconds = ((i + 1) < argc)? _tcstoul(argv[i + 1], NULL, 10) : 0;
+				if (seconds == 0 || seconds > (0xFFFFFFFF / 1000))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing or invalid number of seconds for switch -timeout\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_dwTimeout = (DWORD) seconds * 1000;
+				i++;
 			}
-			else if (_tcscmp(argv[i], _T("-progress")) == 0)
+			else if (_tcscmp(argv[i], _T("-backend")) == 0)
 			{
-				bShowProgress = true;
+				if ((i + 1) >= argc)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -backend\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i + 1], _T("builtin")) == 0)
+					g_hashBackend = BACKEND_BUILTIN;
+				else if (_tcsicmp(argv[i + 1], _T("cng")) == 0)
+					g_hashBackend = BACKEND_CNG;
+				else if (_tcsicmp(argv[i + 1], _T("auto")) == 0)
+					g_hashBackend = BACKEND_AUTO;
+				else
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid argument for switch -backend (builtin, cng or auto)\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+				i++;
+			}
+			else if (_tcscmp(argv[i], _T("-calibrate")) == 0)
+			{
+				bCalibrate = true;
+				g_hashBackend = BACKEND_AUTO;
+			}
+			else if (_tcscmp(argv[i], _T("-priority")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing priority argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -priority\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (!SetRunPriority(argv[i + 1]))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid priority \"%s\"\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				i++;
 			}
 			else
 			{
 				pHash = Hash::GetHash(argv[i]);
 				if (!pHash)
 				{
-					if (outputFile) fclose(outputFile);               
+					CloseOutput();               
 					ShowUsage();
 					ShowError(_T("Error: Argument \"%s\" not recognized\n"), argv[i]);
 					WaitForExit(bDontWait);
@@ -693,6 +5424,80 @@ int _tmain(int argc, _TCHAR* argv[])
 	if (!pHash)
 		pHash = new Sha1();
 
+	// the algorithm may have been given before -backend
+	if (g_hashBackend != BACKEND_BUILTIN)
+	{
+		// when CNG is not available, hashes are silently computed by the built-in implementations
+		if (!LoadCng())
+			g_hashBackend = BACKEND_BUILTIN;
+		else if (g_hashBackend == BACKEND_AUTO)
+			SelectBackend(pHash->GetID(), bCalibrate, bQuiet);
+
+		Hash* pBackendHash = Hash::GetHash(pHash->GetID());
+		delete pHash;
+		pHash = pBackendHash;
+	}
+
+	if (g_iThreads > 1)
+	{
+		LPCTSTR szConflict = !bSumMode? _T("can only be used with -sum") : g_dwIoTimeout? _T("cannot be combined with -iotimeout") : g_bCacheFirst? _T("cannot be combined with -cachefirst") : g_iPipelineDepth? _T("cannot be combined with -pipeline") : NULL;
+		if (szConflict)
+		{
+			delete pHash;
+			ShowUsage();
+			ShowError(_T("Error: Switch -threads %s\n"), szConflict);
+			WaitForExit(bDontWait);
+			return 1;
+		}
+	}
+
+	if (g_ullMinSize > g_ullMaxSize || (g_ullNewerThan && g_ullOlderThan && g_ullNewerThan >= g_ullOlderThan))
+	{
+		delete pHash;
+		ShowUsage();
+		ShowError(_T("Error: The filters given with -minsize/-maxsize or -newer/-older select no file\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (g_iQueueDepth && g_dwIoTimeout)
+	{
+		delete pHash;
+		ShowUsage();
+		ShowError(_T("Error: Switch -queuedepth cannot be combined with -iotimeout\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (g_bCacheFirst)
+	{
+		if (!bSumMode)
+		{
+			delete pHash;
+			ShowUsage();
+			ShowError(_T("Error: Switch -cachefirst can only be used with -sum\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		// uncached files are read ahead while the cached ones are hashed
+		if (!g_iPrefetchFiles)
+			g_iPrefetchFiles = 16;
+	}
+
+	if (g_iWorkers)
+	{
+		LPCTSTR szConflict = !bSumMode? _T("can only be used with -sum") : CObjectStore::IsObjectStoreUrl(argv[1])? _T("cannot be used with an object store URL") : NULL;
+		if (szConflict)
+		{
+			delete pHash;
+			ShowUsage();
+			ShowError(_T("Error: Switch -workers %s\n"), szConflict);
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		SetWorkerArguments(argc, argv);
+	}
+
 	if (!bQuiet)
 		ShowLogo();
 
@@ -706,6 +5511,21 @@ int _tmain(int argc, _TCHAR* argv[])
 				ShowError (_T("!!!Failed to open the result file for writing!!!\n"));
 			}
 		}
+		else
+			StartOutputWriter();
+	}
+
+	if (!errorFileName.empty())
+	{
+		g_errorFile = _tfopen(errorFileName.c_str(), _T("wt"));
+		if (!g_errorFile)
+		{
+			CloseOutput();
+			delete pHash;
+			ShowError (_T("Error: Failed to open the error manifest \"%s\" for writing\n"), errorFileName.c_str());
+			WaitForExit(bDontWait);
+			return 1;
+		}
 	}
 
 	// Check that the input path plus 3 is not longer than MAX_PATH.
@@ -713,9 +5533,23 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	StringCchLength(argv[1], MAX_PATH, &length_of_arg);
 
-	if (length_of_arg > (MAX_PATH - 3))
+	if (CObjectStore::IsObjectStoreUrl(argv[1]))
 	{
-		if (outputFile) fclose(outputFile);
+		g_pObjectStore = CObjectStore::Open(argv[1], dwError);
+		if (!g_pObjectStore)
+		{
+			CloseOutput();
+			if (g_errorFile) fclose(g_errorFile);
+			delete pHash;
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to list the objects of \"%s\" (error 0x%.8X)\n"), argv[1], dwError);
+			WaitForExit(bDontWait);
+			return (-2);
+		}
+	}
+	else if (length_of_arg > (MAX_PATH - 3))
+	{
+		CloseOutput();
 		delete pHash;
 		if (!bQuiet)
 			ShowError(TEXT("Error: Input directory/file path is too long. Maximum length is %d characters\n"), MAX_PATH);
@@ -724,7 +5558,7 @@ int _tmain(int argc, _TCHAR* argv[])
 	}
 	else if (!PathFileExists(argv[1]))
 	{
-		if (outputFile) fclose(outputFile);
+		CloseOutput();
 		delete pHash;
 		if (!bQuiet)
 			ShowError(TEXT("Error: The given input file doesn't exist\n"));
@@ -738,10 +5572,91 @@ int _tmain(int argc, _TCHAR* argv[])
 			pHash->GetID(), 
 			bSumMode? _T("checksum") : _T("hash"),
 			bStripNames? PathFindFileName(argv[1]) : argv[1]);
+		if (g_profile == PROFILE_PORTABLE)
+			_tprintf(_T("Digest profile: portable v%d\n"), PORTABLE_PROFILE_VERSION);
+		if (g_hashBackend == BACKEND_AUTO)
+			_tprintf(_T("Backend: %s (calibrated)\n"), pHash->GetBackend()? pHash->GetBackend() : _T("built-in"));
+		else if (pHash->GetBackend())
+			_tprintf(_T("Backend: %s\n"), pHash->GetBackend());
+		else if (g_hashBackend == BACKEND_CNG)
+			_tprintf(_T("Backend: built-in (%s is not provided by CNG)\n"), pHash->GetID());
+		if (g_bFilterFiles)
+			_tprintf(_T("Filters: %s\n"), GetFilterDescription().c_str());
 		fflush(stdout);
 	}
 
-	if (PathIsDirectory(argv[1]))
+	// sum files record the filters as a comment line, which checksum verifiers skip
+	if (g_bFilterFiles && bSumMode && outputFile && !szWorkerSubdir)
+		OutputPrintf(_T("# Filters: %s\n"), GetFilterDescription().c_str());
+
+	if (g_bGitIgnore)
+		g_ignoreTree.SetRoot(argv[1]);
+
+	g_bQuietReport = bQuiet;
+	g_bSumReport = bSumMode;
+
+	SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+	g_dwStartTicks = GetTickCount();
+
+	// parallel hashing enumerates the whole tree anyway, which gives the totals
+	if (bPrescan && !(g_iThreads > 1 && bSumMode) && !g_iWorkers)
+	{
+		if (g_pObjectStore)
+			dwError = g_pObjectStore->IsDirectory(g_pObjectStore->GetRootName())? PrescanTree(g_pObjectStore->GetRootName(), excludeSpecList) : 0;
+		else if (PathIsDirectory(argv[1]))
+			dwError = PrescanTree(argv[1], excludeSpecList);
+		else
+		{
+			WIN32_FILE_ATTRIBUTE_DATA fileData;
+			if (GetFileAttributesEx(argv[1], GetFileExInfoStandard, &fileData))
+			{
+				g_ullPrescanFiles = 1;
+				g_ullPrescanBytes = ((unsigned long long) fileData.nFileSizeHigh << 32) | fileData.nFileSizeLow;
+			}
+		}
+
+		if (dwError == ERROR_CANCELLED || dwError == ERROR_TIMEOUT)
+			ShowPartialReport (dwError, NULL);
+		else if (!bQuiet)
+			_tprintf(_T("Pre-scan: %I64u file(s), %I64u bytes to hash\n"), g_ullPrescanFiles, g_ullPrescanBytes);
+	}
+
+	if (g_iPipelineDepth)
+	{
+		g_pReadPipeline = new CReadPipeline(g_iPipelineDepth);
+		if (!g_pReadPipeline->IsRunning())
+		{
+			delete g_pReadPipeline;
+			g_pReadPipeline = NULL;
+		}
+	}
+
+	// prefetching only helps local files, which go through the system cache
+	if (g_iPrefetchFiles && !g_pObjectStore)
+	{
+		g_pPrefetcher = new CPrefetcher();
+		if (!g_pPrefetcher->IsRunning())
+		{
+			delete g_pPrefetcher;
+			g_pPrefetcher = NULL;
+		}
+	}
+
+	if (dwError)
+	{
+		// interrupted during the pre-scan: nothing was hashed
+	}
+	else if (g_pObjectStore)
+	{
+		// objects are hashed as if the tree had been downloaded into a directory named after the root
+		LPCTSTR szRootName = g_pObjectStore->GetRootName();
+		SetNameRoot(szRootName);
+		if (g_pObjectStore->IsDirectory(szRootName))
+			dwError = HashTree(szRootName, pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+		else
+			dwError = HashFile(szRootName, pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+	}
+	else if (PathIsDirectory(argv[1]))
 	{
 		// remove any trailing backslash to harmonize directory names in case they are included
 		// in hash computations
@@ -753,26 +5668,52 @@ int _tmain(int argc, _TCHAR* argv[])
 			argv[1][pathLen - 1] = 0;
 		}
 
-		dwError = HashDirectory(argv[1], pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+		SetNameRoot(argv[1]);
+		if (szWorkerSubdir)
+		{
+			CDirContent subdir(argv[1], szWorkerSubdir, true);
+			size_t cchRoot = bIncludeNames? g_namePath.Push(subdir.GetName()) : 0;
+			dwError = HashTree(subdir.GetPath(), pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+			if (bIncludeNames)
+				g_namePath.Pop(cchRoot);
+		}
+		else if (g_iWorkers)
+			dwError = HashDirectoryWithWorkers(argv[1], pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress);
+		else
+			dwError = HashTree(argv[1], pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
 
 		// restore backslash
 		if (backslash)
 			argv[1][pathLen - 1] = backslash;
 	}
 	else
+	{
+		SetNameRoot(argv[1]);
 		dwError = HashFile(argv[1], pHash, bIncludeNames, bStripNames, excludeSpecList, bQuiet, bShowProgress, bSumMode);
+	}
 
 	if (dwError == NO_ERROR)
 	{
 		if (!bSumMode)
-		{
 			pHash->Final(pbDigest);
 
+		if (!bSumMode && (dwError = pHash->GetError()) != 0)
+			ShowError(_T("Failed to compute the %s hash (error 0x%.8X)\n"), pHash->GetID(), dwError);
+		else if (!bSumMode)
+		{
 			if (!bQuiet)
 			{
-				if (outputFile)
+				if (outputFile && g_bFilterFiles)
 				{
-					_ftprintf(outputFile, __T("%s hash of \"%s\" (%d bytes) = "), 
+					OutputPrintf(__T("%s hash of \"%s\" (%d bytes, filters: %s) = "), 
+						pHash->GetID(), 
+						PathFindFileName(argv[1]), 
+						pHash->GetHashSize(),
+						GetFilterDescription().c_str());
+				}
+				else if (outputFile)
+				{
+					OutputPrintf(__T("%s hash of \"%s\" (%d bytes) = "), 
 						pHash->GetID(), 
 						PathFindFileName(argv[1]), 
 						pHash->GetHashSize());
@@ -783,10 +5724,10 @@ int _tmain(int argc, _TCHAR* argv[])
 			// display hash in yellow
 			SetConsoleTextAttribute (g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
 
-			ToHex (pbDigest, pHash->GetHashSize(), szDigestHex);
+			DigestEncode (g_digestEncoding, pbDigest, pHash->GetHashSize(), szDigestHex);
 
 			_tprintf(szDigestHex);
-			if (outputFile) _ftprintf(outputFile, szDigestHex);
+			if (outputFile) OutputPrintf(szDigestHex);
 
 			if (bCopyToClipboard)
 				CopyToClipboard (szDigestHex);
@@ -794,14 +5735,46 @@ int _tmain(int argc, _TCHAR* argv[])
 			// restore normal text color
 			SetConsoleTextAttribute (g_hConsole, g_wAttributes);
 
+			// a partial digest must never be taken for a complete one, even in quiet mode
+			if (g_ullErrorCount)
+			{
+				_tprintf(_T(" (partial: %I64u error(s))"), g_ullErrorCount);
+				if (outputFile) OutputPrintf(_T(" (partial: %I64u error(s))"), g_ullErrorCount);
+			}
+
 			_tprintf(_T("\n"));
-			if (outputFile) _ftprintf(outputFile, _T("\n"));
+			if (outputFile) OutputPrintf(_T("\n"));
+		}
+
+		if (g_pReadPipeline && !bQuiet)
+			g_pReadPipeline->ShowStatistics();
+
+		if (g_bCacheFirst && !bQuiet)
+		{
+			_tprintf(_T("Cache-first: %I64u file(s) (%I64u bytes) were found in cache, %I64u file(s) (%I64u bytes) were read from disk\n"),
+				g_ullCachedFiles, g_ullCachedBytes, g_ullUncachedFiles, g_ullUncachedBytes);
 		}
 
+		if (g_ullErrorCount && dwError == NO_ERROR)
+		{
+			if (!bQuiet)
+				ShowError(_T("%I64u error(s) occurred, the result is partial.%s\n"), g_ullErrorCount, g_errorFile? _T(" See the error manifest for details.") : _T(""));
+			dwError = DIRHASH_EXIT_PARTIAL;
+		}
 	}
 
 	delete pHash;
-	if (outputFile) fclose(outputFile);
+	CloseOutput();
+	if (g_errorFile) fclose(g_errorFile);
+	if (g_pIoWorker) g_pIoWorker->Stop();
+	delete g_pObjectStore;
+	if (g_pPrefetcher && g_pPrefetcher->Stop())
+		delete g_pPrefetcher;
+	if (g_pReadPipeline)
+	{
+		g_pReadPipeline->Stop();
+		delete g_pReadPipeline;
+	}
 
 	SecureZeroMemory (g_pbBuffer, sizeof (g_pbBuffer));
 	SecureZeroMemory (pbDigest, sizeof (pbDigest));
@@ -0,0 +1,258 @@
+/*
+* KangarooTwelve (KT128) as specified in RFC 9861.
+*
+* TurboSHAKE128 is a sponge with a 168-byte rate over Keccak-p[1600,12],
+* i.e. the last 12 rounds of Keccak-f[1600]. Lanes are loaded and stored in
+* little-endian order whatever the byte order of the host.
+*/
+
+#include "KangarooTwelve.h"
+#include <memory.h>
+
+#define TURBOSHAKE128_RATE	168
+
+/* domain separation bytes */
+#define K12_SUFFIX_SINGLE_NODE	0x07
+#define K12_SUFFIX_LEAF			0x0B
+#define K12_SUFFIX_FINAL_NODE	0x06
+
+#define ROL64(a, n)	(((a) << (n)) | ((a) >> (64 - (n))))
+
+static const uint64 g_keccakRoundConstants[24] =
+{
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+	0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+	0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+	0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+	0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+	0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+/* One round from the lanes of state A to those of state E. Lanes are named
+ * after their coordinates: b, g, k, m, s for y = 0..4 and a, e, i, o, u for
+ * x = 0..4. theta, rho, pi, chi and iota are combined on each output plane. */
+#define KECCAK_ROUND(A, E, rc) \
+	Ca = A##ba ^ A##ga ^ A##ka ^ A##ma ^ A##sa; \
+	Ce = A##be ^ A##ge ^ A##ke ^ A##me ^ A##se; \
+	Ci = A##bi ^ A##gi ^ A##ki ^ A##mi ^ A##si; \
+	Co = A##bo ^ A##go ^ A##ko ^ A##mo ^ A##so; \
+	Cu = A##bu ^ A##gu ^ A##ku ^ A##mu ^ A##su; \
+	Da = Cu ^ ROL64(Ce, 1); \
+	De = Ca ^ ROL64(Ci, 1); \
+	Di = Ce ^ ROL64(Co, 1); \
+	Do = Ci ^ ROL64(Cu, 1); \
+	Du = Co ^ ROL64(Ca, 1); \
+	Ba = A##ba ^ Da; \
+	Be = ROL64(A##ge ^ De, 44); \
+	Bi = ROL64(A##ki ^ Di, 43); \
+	Bo = ROL64(A##mo ^ Do, 21); \
+	Bu = ROL64(A##su ^ Du, 14); \
+	E##ba = Ba ^ (~Be & Bi) ^ (rc); \
+	E##be = Be ^ (~Bi & Bo); \
+	E##bi = Bi ^ (~Bo & Bu); \
+	E##bo = Bo ^ (~Bu & Ba); \
+	E##bu = Bu ^ (~Ba & Be); \
+	Ba = ROL64(A##bo ^ Do, 28); \
+	Be = ROL64(A##gu ^ Du, 20); \
+	Bi = ROL64(A##ka ^ Da, 3); \
+	Bo = ROL64(A##me ^ De, 45); \
+	Bu = ROL64(A##si ^ Di, 61); \
+	E##ga = Ba ^ (~Be & Bi); \
+	E##ge = Be ^ (~Bi & Bo); \
+	E##gi = Bi ^ (~Bo & Bu); \
+	E##go = Bo ^ (~Bu & Ba); \
+	E##gu = Bu ^ (~Ba & Be); \
+	Ba = ROL64(A##be ^ De, 1); \
+	Be = ROL64(A##gi ^ Di, 6); \
+	Bi = ROL64(A##ko ^ Do, 25); \
+	Bo = ROL64(A##mu ^ Du, 8); \
+	Bu = ROL64(A##sa ^ Da, 18); \
+	E##ka = Ba ^ (~Be & Bi); \
+	E##ke = Be ^ (~Bi & Bo); \
+	E##ki = Bi ^ (~Bo & Bu); \
+	E##ko = Bo ^ (~Bu & Ba); \
+	E##ku = Bu ^ (~Ba & Be); \
+	Ba = ROL64(A##bu ^ Du, 27); \
+	Be = ROL64(A##ga ^ Da, 36); \
+	Bi = ROL64(A##ke ^ De, 10); \
+	Bo = ROL64(A##mi ^ Di, 15); \
+	Bu = ROL64(A##so ^ Do, 56); \
+	E##ma = Ba ^ (~Be & Bi); \
+	E##me = Be ^ (~Bi & Bo); \
+	E##mi = Bi ^ (~Bo & Bu); \
+	E##mo = Bo ^ (~Bu & Ba); \
+	E##mu = Bu ^ (~Ba & Be); \
+	Ba = ROL64(A##bi ^ Di, 62); \
+	Be = ROL64(A##go ^ Do, 55); \
+	Bi = ROL64(A##ku ^ Du, 39); \
+	Bo = ROL64(A##ma ^ Da, 41); \
+	Bu = ROL64(A##se ^ De, 2); \
+	E##sa = Ba ^ (~Be & Bi); \
+	E##se = Be ^ (~Bi & Bo); \
+	E##si = Bi ^ (~Bo & Bu); \
+	E##so = Bo ^ (~Bu & Ba); \
+	E##su = Bu ^ (~Ba & Be);
+
+/* the last nRounds (an even number) rounds of Keccak-f[1600] */
+static void KeccakP1600(uint64 *state, int nRounds)
+{
+	uint64 Aba, Abe, Abi, Abo, Abu, Aga, Age, Agi, Ago, Agu, Aka, Ake, Aki, Ako, Aku;
+	uint64 Ama, Ame, Ami, Amo, Amu, Asa, Ase, Asi, Aso, Asu;
+	uint64 Eba, Ebe, Ebi, Ebo, Ebu, Ega, Ege, Egi, Ego, Egu, Eka, Eke, Eki, Eko, Eku;
+	uint64 Ema, Eme, Emi, Emo, Emu, Esa, Ese, Esi, Eso, Esu;
+	uint64 Ba, Be, Bi, Bo, Bu, Ca, Ce, Ci, Co, Cu, Da, De, Di, Do, Du;
+	int round;
+
+	Aba = state[0];  Abe = state[1];  Abi = state[2];  Abo = state[3];  Abu = state[4];
+	Aga = state[5];  Age = state[6];  Agi = state[7];  Ago = state[8];  Agu = state[9];
+	Aka = state[10]; Ake = state[11]; Aki = state[12]; Ako = state[13]; Aku = state[14];
+	Ama = state[15]; Ame = state[16]; Ami = state[17]; Amo = state[18]; Amu = state[19];
+	Asa = state[20]; Ase = state[21]; Asi = state[22]; Aso = state[23]; Asu = state[24];
+
+	for (round = 24 - nRounds; round < 24; round += 2)
+	{
+		KECCAK_ROUND(A, E, g_keccakRoundConstants[round])
+		KECCAK_ROUND(E, A, g_keccakRoundConstants[round + 1])
+	}
+
+	state[0] = Aba;  state[1] = Abe;  state[2] = Abi;  state[3] = Abo;  state[4] = Abu;
+	state[5] = Aga;  state[6] = Age;  state[7] = Agi;  state[8] = Ago;  state[9] = Agu;
+	state[10] = Aka; state[11] = Ake; state[12] = Aki; state[13] = Ako; state[14] = Aku;
+	state[15] = Ama; state[16] = Ame; state[17] = Ami; state[18] = Amo; state[19] = Amu;
+	state[20] = Asa; state[21] = Ase; state[22] = Asi; state[23] = Aso; state[24] = Asu;
+}
+
+static uint64 LoadLane(const byte *p)
+{
+	return (uint64) p[0] | ((uint64) p[1] << 8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24)
+		| ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+static void TurboSHAKE_Init(TURBOSHAKE_STATE *state)
+{
+	memset(state->A, 0, sizeof(state->A));
+	state->position = 0;
+}
+
+static void TurboSHAKE_Absorb(TURBOSHAKE_STATE *state, const byte *data, size_t len)
+{
+	while (len)
+	{
+		if (state->position == 0 && len >= TURBOSHAKE128_RATE)
+		{
+			/* whole blocks are absorbed a lane at a time */
+			int i;
+			for (i = 0; i < TURBOSHAKE128_RATE / 8; i++)
+				state->A[i] ^= LoadLane(data + 8 * i);
+			KeccakP1600(state->A, 12);
+			data += TURBOSHAKE128_RATE;
+			len -= TURBOSHAKE128_RATE;
+		}
+		else
+		{
+			state->A[state->position >> 3] ^= (uint64) *data++ << (8 * (state->position & 7));
+			len--;
+			if (++state->position == TURBOSHAKE128_RATE)
+			{
+				KeccakP1600(state->A, 12);
+				state->position = 0;
+			}
+		}
+	}
+}
+
+/* pad with the domain separation byte and squeeze outLen bytes (at most one block) */
+static void TurboSHAKE_Final(TURBOSHAKE_STATE *state, byte suffix, byte *out, size_t outLen)
+{
+	size_t i;
+
+	state->A[state->position >> 3] ^= (uint64) suffix << (8 * (state->position & 7));
+	state->A[(TURBOSHAKE128_RATE - 1) >> 3] ^= (uint64) 0x80 << (8 * ((TURBOSHAKE128_RATE - 1) & 7));
+	KeccakP1600(state->A, 12);
+
+	for (i = 0; i < outLen; i++)
+		out[i] = (byte) (state->A[i >> 3] >> (8 * (i & 7)));
+}
+
+void K12_init(K12_CTX *ctx)
+{
+	TurboSHAKE_Init(&ctx->finalNode);
+	TurboSHAKE_Init(&ctx->leafNode);
+	ctx->chunkPosition = 0;
+	ctx->leafCount = 0;
+}
+
+/* absorb the chaining value of the completed leaf into the final node */
+static void K12_CompleteLeaf(K12_CTX *ctx)
+{
+	byte chainingValue[K12_DIGEST_SIZE];
+
+	TurboSHAKE_Final(&ctx->leafNode, K12_SUFFIX_LEAF, chainingValue, sizeof(chainingValue));
+	TurboSHAKE_Absorb(&ctx->finalNode, chainingValue, sizeof(chainingValue));
+	TurboSHAKE_Init(&ctx->leafNode);
+	ctx->chunkPosition = 0;
+}
+
+void K12_add(K12_CTX *ctx, const byte *msg, size_t len)
+{
+	static const byte treeMarker[8] = { 0x03, 0, 0, 0, 0, 0, 0, 0 };
+
+	while (len)
+	{
+		size_t n;
+
+		/* a chunk is only closed when more data follows it, since the input
+		 * decides between the single node and the tree forms */
+		if (ctx->chunkPosition == K12_CHUNK_SIZE)
+		{
+			if (ctx->leafCount == 0)
+			{
+				TurboSHAKE_Absorb(&ctx->finalNode, treeMarker, sizeof(treeMarker));
+				ctx->chunkPosition = 0;
+			}
+			else
+				K12_CompleteLeaf(ctx);
+			ctx->leafCount++;
+		}
+
+		n = K12_CHUNK_SIZE - ctx->chunkPosition;
+		if (n > len)
+			n = len;
+		TurboSHAKE_Absorb(ctx->leafCount? &ctx->leafNode : &ctx->finalNode, msg, n);
+		ctx->chunkPosition += n;
+		msg += n;
+		len -= n;
+	}
+}
+
+void K12_finalize(K12_CTX *ctx, byte *out)
+{
+	static const byte emptyCustomization = 0x00;	/* length_encode(0) */
+
+	K12_add(ctx, &emptyCustomization, 1);
+
+	if (ctx->leafCount == 0)
+		TurboSHAKE_Final(&ctx->finalNode, K12_SUFFIX_SINGLE_NODE, out, K12_DIGEST_SIZE);
+	else
+	{
+		byte lengthEncoding[sizeof(size_t) + 3];
+		size_t count = ctx->leafCount;
+		int cbCount = 0, i;
+
+		K12_CompleteLeaf(ctx);
+
+		/* length_encode(number of chaining values) followed by 0xFFFF */
+		for (; count; count >>= 8)
+			cbCount++;
+		for (i = 0, count = ctx->leafCount; i < cbCount; i++)
+			lengthEncoding[cbCount - 1 - i] = (byte) (count >> (8 * i));
+		lengthEncoding[cbCount] = (byte) cbCount;
+		lengthEncoding[cbCount + 1] = 0xFF;
+		lengthEncoding[cbCount + 2] = 0xFF;
+		TurboSHAKE_Absorb(&ctx->finalNode, lengthEncoding, cbCount + 3);
+
+		TurboSHAKE_Final(&ctx->finalNode, K12_SUFFIX_FINAL_NODE, out, K12_DIGEST_SIZE);
+	}
+
+	memset(ctx, 0, sizeof(K12_CTX));
+}
@@ -0,0 +1,46 @@
+/*
+* KangarooTwelve (KT128, RFC 9861): a tree hash over the Keccak-p[1600,12]
+* permutation. Inputs are cut into 8 KB chunks; every chunk after the first
+* one is hashed into a 32-byte chaining value, and the final node absorbs the
+* first chunk followed by these chaining values.
+*
+* The streaming interface hashes a message with an empty customization
+* string and produces a 32-byte digest.
+*/
+
+#ifndef KANGAROO_TWELVE_H
+#define KANGAROO_TWELVE_H
+
+#include "defs.h"
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define K12_DIGEST_SIZE	32
+#define K12_CHUNK_SIZE	8192
+
+typedef struct
+{
+	uint64 A[25];
+	unsigned int position;	/* bytes absorbed in the current block of the rate */
+} TURBOSHAKE_STATE;
+
+typedef struct
+{
+	TURBOSHAKE_STATE finalNode;
+	TURBOSHAKE_STATE leafNode;
+	size_t chunkPosition;	/* bytes absorbed in the current chunk */
+	size_t leafCount;		/* chunks after the first one, the current one included */
+} K12_CTX;
+
+void K12_init(K12_CTX *ctx);
+void K12_add(K12_CTX *ctx, const byte *msg, size_t len);
+void K12_finalize(K12_CTX *ctx, byte *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif